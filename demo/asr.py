@@ -1,12 +1,24 @@
 from third_party.whisper_online import *
-import io
-import soundfile
+import json
 import socket
+import struct
 import sys
 import argparse
 import numpy as np
 
 
+def ulaw_table():
+    """
+    G.711 mu-law to float32, same table as the router
+    """
+    table = np.zeros(256, dtype=np.float32)
+    for i in range(256):
+        u = ~i & 0xFF
+        v = (((u & 0x0F) << 3) + 0x84) << ((u & 0x70) >> 4)
+        table[i] = ((0x84 - v) if u & 0x80 else (v - 0x84)) / 32768.0
+    return table
+
+
 class StreamProcessor:
     """
     Current server input processing class
@@ -15,12 +27,19 @@ class StreamProcessor:
     2. Create a socket
     3. Connect to Current server and start receiving audio stream
     4. Show the output every time we have changes on c/u buffers
+
+    The router starts every call with a JSON handshake and waits for a sync
+    byte. Audio is raw 16 kHz float32 ("f32") or, when the node config sets a
+    wire_format, frames of a 16 byte header (version, format, flags, seq,
+    timestamp, payload size) and s16 or mu-law payload. Frames flagged as
+    silence carry the number of samples the router VAD skipped.
     """
 
     MAX_SIZE = 64000
     SAMPLING_RATE = 16000
-    BYTE_FORMAT = "PCM_32"
-    ENDIAN = "LITTLE"
+    HEADER = struct.Struct("<BBHIII")
+    ULAW = ulaw_table()
+    SILENCE = 1
 
     def __init__(self, online_asr_proc, min_chunk, host, port):
         self.online_asr_proc = online_asr_proc
@@ -28,6 +47,75 @@ class StreamProcessor:
         self.host = host
         self.port = port
         self.connection = None
+        self.buffer = b""
+        self.wire_format = "f32"
+
+    def receive(self):
+        raw_bytes = self.connection.recv(self.MAX_SIZE)
+        self.buffer += raw_bytes
+        return len(raw_bytes) > 0
+
+    def handshake(self):
+        """
+        Reads the call handshake and confirms it with the sync byte
+        """
+        depth, in_string, escaped, pos = 0, False, False, 0
+        while True:
+            while pos < len(self.buffer):
+                c = self.buffer[pos : pos + 1]
+                pos += 1
+                if in_string:
+                    if escaped:
+                        escaped = False
+                    elif c == b"\\":
+                        escaped = True
+                    elif c == b'"':
+                        in_string = False
+                elif c == b'"':
+                    in_string = True
+                elif c == b"{":
+                    depth += 1
+                elif c == b"}":
+                    depth -= 1
+                    if depth == 0:
+                        message = json.loads(self.buffer[:pos])
+                        self.buffer = self.buffer[pos:]
+                        self.wire_format = message.get("wire_format") or "f32"
+                        print(
+                            "Call %s, wire format %s"
+                            % (message.get("call_id"), self.wire_format),
+                            file=sys.stderr,
+                        )
+                        self.connection.sendall(b"\x01")
+                        return True
+            if not self.receive():
+                return False
+
+    def decode(self):
+        """
+        Decodes the complete samples or frames of the receive buffer
+        """
+        if self.wire_format == "f32":
+            size = len(self.buffer) // 4 * 4
+            audio = np.frombuffer(self.buffer[:size], dtype="<f4")
+            self.buffer = self.buffer[size:]
+            return [audio]
+        out = []
+        while len(self.buffer) >= self.HEADER.size:
+            _, fmt, flags, _, _, size = self.HEADER.unpack_from(self.buffer)
+            if len(self.buffer) < self.HEADER.size + size:
+                break
+            payload = self.buffer[self.HEADER.size : self.HEADER.size + size]
+            self.buffer = self.buffer[self.HEADER.size + size :]
+            if flags & self.SILENCE:
+                # Skipped by the router VAD, keep the timeline with zeros
+                (count,) = struct.unpack("<I", payload)
+                out.append(np.zeros(count, dtype=np.float32))
+            elif fmt == 1:
+                out.append(np.frombuffer(payload, dtype="<i2") / np.float32(32768))
+            elif fmt == 2:
+                out.append(self.ULAW[np.frombuffer(payload, dtype=np.uint8)])
+        return out
 
     def next_chunk(self):
         """
@@ -35,22 +123,13 @@ class StreamProcessor:
         """
         out = []
         while sum(len(x) for x in out) < self.min_chunk * self.SAMPLING_RATE:
-            raw_bytes = self.connection.recv(self.MAX_SIZE)
-            if not raw_bytes:
+            if not self.receive():
                 break
-            sf = soundfile.SoundFile(
-                io.BytesIO(raw_bytes),
-                channels=1,
-                endian=self.ENDIAN,
-                samplerate=self.SAMPLING_RATE,
-                subtype=self.BYTE_FORMAT,
-                format="RAW",
-            )
-            audio, _ = librosa.load(sf, sr=self.SAMPLING_RATE, dtype=np.float32)
-            out.append(audio)
+            out.extend(self.decode())
+        out = [x for x in out if len(x)]
         if not out:
             return None
-        return np.concatenate(out)
+        return np.concatenate(out).astype(np.float32)
 
     def worker(self):
         """
@@ -64,8 +143,10 @@ class StreamProcessor:
             while True:
                 conn, addr = s.accept()
                 self.connection = conn
+                self.buffer = b""
                 print("Connected", file=sys.stderr)
-                self.process()
+                if self.handshake():
+                    self.process()
                 conn.close()
                 print("Disconnected", file=sys.stderr)
 
@@ -78,6 +159,12 @@ class StreamProcessor:
             o[2] for o in self.online_asr_proc.transcript_buffer.buffer
         )
         print("%s[%s]" % (commited, uncommited), file=sys.stderr)
+        # One JSON line per result, the router relays it to the PBX
+        result = {"committed": commited, "text": uncommited}
+        try:
+            self.connection.sendall((json.dumps(result) + "\n").encode())
+        except OSError:
+            pass
 
     def process(self):
         """
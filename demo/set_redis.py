@@ -14,6 +14,8 @@ def main():
         "default": [{"host": "0.0.0.0", "port": 9999}]
     }
     db.set(CONFIG_FIELD, json.dumps(data))
+    # Routers subscribed to the config channel resync right away
+    db.publish(CONFIG_FIELD, '1')
     print('done')
     print(db.get(CONFIG_FIELD))
 
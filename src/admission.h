@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Per tenant admission control. Limits are keyed on an account id or on a
+// node selector and checked once per call at handshake time, so rejected
+// calls never reach a node. Counters are atomics shared by every call of
+// the key, the table of keys is swapped on config updates like the routing.
+
+struct TenantLimits final {
+  // 0 is unlimited
+  uint32_t streams = 0;
+  double calls_per_sec = 0;
+  // New calls allowed at once, one second of calls_per_sec if 0
+  double calls_burst = 0;
+  uint64_t bytes_per_sec = 0;
+};
+
+enum class LimitReason : uint32_t { None = 0, Streams, Calls, Bytes, Count };
+
+inline const char *limit_reason_name(LimitReason reason) {
+  static const char *names[] = {"none", "streams", "calls", "bytes"};
+  return names[static_cast<size_t>(reason)];
+}
+
+inline int64_t limit_clock_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class RateBucket final {
+  // Token bucket as a single atomic (GCRA): the time at which the bucket
+  // is full again. Taking cost moves it forward, and fails when it would
+  // end up more than one burst ahead of now.
+  std::atomic<int64_t> full_at_{0};
+
+  static int64_t span_ns(double units, double rate) {
+    return int64_t(units * 1e9 / rate);
+  }
+
+public:
+  bool Take(double cost, double rate, double burst, int64_t now) {
+    const auto increment = span_ns(cost, rate);
+    const auto tolerance = span_ns(burst, rate);
+    auto full_at = full_at_.load(std::memory_order_relaxed);
+    while (true) {
+      auto next = std::max(full_at, now) + increment;
+      if (next - now > tolerance) {
+        return false;
+      }
+      if (full_at_.compare_exchange_weak(full_at, next,
+                                         std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+  // Takes cost even past the burst, for traffic already admitted. The debt
+  // is capped at one more burst so the tenant recovers in bounded time.
+  void Charge(double cost, double rate, double burst, int64_t now) {
+    const auto increment = span_ns(cost, rate);
+    const auto cap = now + 2 * span_ns(burst, rate);
+    auto full_at = full_at_.load(std::memory_order_relaxed);
+    while (!full_at_.compare_exchange_weak(
+        full_at, std::min(std::max(full_at, now) + increment, cap),
+        std::memory_order_relaxed)) {
+    }
+  }
+  // Gives back cost taken by Take, a bucket refilled past now stays full
+  void Refund(double cost, double rate) {
+    full_at_.fetch_sub(span_ns(cost, rate), std::memory_order_relaxed);
+  }
+  // False while the bucket is empty
+  bool Available(double rate, double burst, int64_t now) const {
+    return full_at_.load(std::memory_order_relaxed) - now <
+           span_ns(burst, rate);
+  }
+};
+
+class TenantLimiter final {
+  std::atomic<uint32_t> max_streams_{0};
+  std::atomic<double> calls_per_sec_{0};
+  std::atomic<double> calls_burst_{0};
+  std::atomic<uint64_t> bytes_per_sec_{0};
+  std::atomic<int32_t> streams_{0};
+  RateBucket calls_;
+  RateBucket bytes_;
+
+public:
+  std::array<std::atomic<uint64_t>, static_cast<size_t>(LimitReason::Count)>
+      rejected{};
+
+  // Applied in place so live calls keep counting against the key
+  void Set(const TenantLimits &limits) {
+    max_streams_ = limits.streams;
+    calls_per_sec_ = limits.calls_per_sec;
+    calls_burst_ = limits.calls_burst > 0 ? limits.calls_burst
+                                          : std::max(limits.calls_per_sec, 1.0);
+    bytes_per_sec_ = limits.bytes_per_sec;
+  }
+
+  // Takes a stream and a call token, Release gives the stream back
+  LimitReason Admit(int64_t now) {
+    auto reason = Check(now);
+    if (reason != LimitReason::None) {
+      rejected[static_cast<size_t>(reason)].fetch_add(
+          1, std::memory_order_relaxed);
+    }
+    return reason;
+  }
+  void Release() { streams_.fetch_sub(1, std::memory_order_relaxed); }
+  // Undoes an Admit for a call turned away by another limiter
+  void Cancel() {
+    Release();
+    auto calls_rate = calls_per_sec_.load(std::memory_order_relaxed);
+    if (calls_rate > 0) {
+      calls_.Refund(1, calls_rate);
+    }
+  }
+
+  // Audio of admitted calls, only new calls are turned away once it runs
+  // over the budget
+  void Charge(uint64_t bytes, int64_t now) {
+    auto rate = bytes_per_sec_.load(std::memory_order_relaxed);
+    if (rate > 0) {
+      bytes_.Charge(double(bytes), double(rate), double(rate), now);
+    }
+  }
+
+  int32_t Streams() const { return streams_.load(std::memory_order_relaxed); }
+
+private:
+  LimitReason Check(int64_t now) {
+    auto bytes_rate = bytes_per_sec_.load(std::memory_order_relaxed);
+    if (bytes_rate > 0 &&
+        !bytes_.Available(double(bytes_rate), double(bytes_rate), now)) {
+      return LimitReason::Bytes;
+    }
+    auto max_streams = max_streams_.load(std::memory_order_relaxed);
+    auto streams = streams_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (max_streams > 0 && uint32_t(streams) > max_streams) {
+      Release();
+      return LimitReason::Streams;
+    }
+    auto calls_rate = calls_per_sec_.load(std::memory_order_relaxed);
+    if (calls_rate > 0 &&
+        !calls_.Take(1, calls_rate,
+                     calls_burst_.load(std::memory_order_relaxed), now)) {
+      Release();
+      return LimitReason::Calls;
+    }
+    return LimitReason::None;
+  }
+};
+
+class AdmissionControl final {
+  // Readers take the current snapshot without locking (RCU), limiters of
+  // keys that stay in the config carry over to the next snapshot
+  using Snapshot = std::map<std::string, std::shared_ptr<TenantLimiter>>;
+  std::mutex update_mutex_;
+  std::shared_ptr<const Snapshot> snapshot_ = std::make_shared<Snapshot>();
+
+  std::shared_ptr<const Snapshot> snapshot() const {
+    return std::atomic_load(&snapshot_);
+  }
+
+public:
+  void Update(const std::map<std::string, TenantLimits> &limits) {
+    std::lock_guard<std::mutex> lock(update_mutex_);
+    auto current = snapshot();
+    auto next = std::make_shared<Snapshot>();
+    for (auto &[key, value] : limits) {
+      auto it = current->find(key);
+      auto limiter = it != current->end() ? it->second
+                                          : std::make_shared<TenantLimiter>();
+      limiter->Set(value);
+      (*next)[key] = std::move(limiter);
+    }
+    std::atomic_store(&snapshot_,
+                      std::shared_ptr<const Snapshot>(std::move(next)));
+  }
+
+  // Admits a call against the limits of its account and of its selector.
+  // Admitted limiters are appended to held, each needs one Release. A call
+  // rejected by its selector gives the account its stream and token back.
+  LimitReason Admit(const std::string &account, const std::string &selector,
+                    std::vector<std::shared_ptr<TenantLimiter>> &held) {
+    auto current = snapshot();
+    if (current->empty()) {
+      return LimitReason::None;
+    }
+    const auto now = limit_clock_ns();
+    for (auto key : {&account, &selector}) {
+      auto it = current->find(*key);
+      if (it == current->end() || (key == &selector && selector == account)) {
+        continue;
+      }
+      auto reason = it->second->Admit(now);
+      if (reason != LimitReason::None) {
+        for (auto &limiter : held) {
+          limiter->Cancel();
+        }
+        held.clear();
+        return reason;
+      }
+      held.push_back(it->second);
+    }
+    return LimitReason::None;
+  }
+
+  template <typename F> void ForEach(F &&f) const {
+    for (auto &[key, limiter] : *snapshot()) {
+      f(key, *limiter);
+    }
+  }
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "upstream.h"
+#include "wire.h"
+
+// Node selection inside a selector. Balancers are immutable snapshots of the
+// node list, the only shared writes are the round robin cursor and the node
+// counters.
+
+enum class BalancerPolicy { RoundRobin, LeastStreams, PowerOfTwo };
+
+inline bool parse_balancer_policy(const std::string &name,
+                                  BalancerPolicy &policy) {
+  if (name == "round_robin") {
+    policy = BalancerPolicy::RoundRobin;
+  } else if (name == "least_streams") {
+    policy = BalancerPolicy::LeastStreams;
+  } else if (name == "p2c") {
+    policy = BalancerPolicy::PowerOfTwo;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+struct BalancedNode final {
+  std::string host;
+  uint16_t port;
+  uint32_t weight;
+  WireFormat wire_format;
+  std::shared_ptr<NodeStats> stats;
+};
+
+class NodeRegistry final {
+  // Stats outlive routing updates as long as the node stays configured
+  std::mutex mutex_;
+  std::map<std::pair<std::string, uint16_t>, std::shared_ptr<NodeStats>> nodes_;
+
+public:
+  // New nodes are resolved before they are returned, so before a routing
+  // update publishes them. Called from the routing update threads only.
+  std::shared_ptr<NodeStats> Get(const std::string &host, uint16_t port) {
+    std::shared_ptr<NodeStats> stats;
+    bool created = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &slot = nodes_[std::make_pair(host, port)];
+      if (!slot) {
+        slot = std::make_shared<NodeStats>();
+        if (auto shared = SharedCounters::Attached()) {
+          slot->shared = shared->Node(host, port);
+        }
+        created = true;
+      }
+      stats = slot;
+    }
+    if (created) {
+      stats->Resolve(host, port);
+    }
+    return stats;
+  }
+  // Refreshes the addresses of all nodes, blocks in the resolver
+  void Resolve() {
+    for (auto &[key, stats] : All()) {
+      stats->Resolve(key.first, key.second);
+    }
+  }
+  std::vector<
+      std::pair<std::pair<std::string, uint16_t>, std::shared_ptr<NodeStats>>>
+  All() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {nodes_.begin(), nodes_.end()};
+  }
+};
+
+class SelectorBalancer final {
+  static constexpr uint32_t kMaxWeight = 100;
+
+  const BalancerPolicy policy_;
+  std::vector<BalancedNode> nodes_;
+  // Smooth weighted round robin order, one entry per weight unit
+  std::vector<uint32_t> schedule_;
+  std::atomic<uint64_t> cursor_{0};
+
+  static uint64_t random() {
+    thread_local uint64_t state =
+        0x9E3779B97F4A7C15ull ^
+        reinterpret_cast<uintptr_t>(&state);
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+  // Streams per weight unit, scaled to stay in integers
+  static uint64_t load(const BalancedNode &node) {
+    return uint64_t(std::max(node.stats->Streams(), 0)) * 1000 / node.weight;
+  }
+  static bool less_loaded(const BalancedNode &a, const BalancedNode &b) {
+    auto la = load(a), lb = load(b);
+    if (la != lb) {
+      return la < lb;
+    }
+    return a.stats->handshake_us.load(std::memory_order_relaxed) <
+           b.stats->handshake_us.load(std::memory_order_relaxed);
+  }
+
+public:
+  SelectorBalancer(BalancerPolicy policy, std::vector<BalancedNode> nodes)
+      : policy_(policy), nodes_(std::move(nodes)) {
+    std::vector<int64_t> current(nodes_.size(), 0);
+    int64_t total = 0;
+    for (auto &node : nodes_) {
+      node.weight = std::min(std::max(node.weight, 1u), kMaxWeight);
+      total += node.weight;
+    }
+    for (int64_t step = 0; step < total; step++) {
+      size_t best = 0;
+      for (size_t i = 0; i < nodes_.size(); i++) {
+        current[i] += nodes_[i].weight;
+        if (current[i] > current[best]) {
+          best = i;
+        }
+      }
+      current[best] -= total;
+      schedule_.push_back(best);
+    }
+  }
+  SelectorBalancer(const SelectorBalancer &) = delete;
+
+  bool Empty() const { return nodes_.empty(); }
+  const std::vector<BalancedNode> &Nodes() const { return nodes_; }
+
+  // Picks a node that is neither excluded nor ejected by its circuit breaker.
+  // If every node is ejected the breakers are ignored rather than failing the
+  // call, nullptr means all nodes were excluded.
+  const BalancedNode *Pick(const std::vector<const NodeStats *> &exclude = {}) {
+    auto n = cursor_.fetch_add(1, std::memory_order_relaxed);
+    std::vector<bool> usable(nodes_.size(), false);
+    size_t usable_count = 0;
+    bool ignore_breakers = false;
+    for (int pass = 0; pass < 2 && usable_count == 0; pass++) {
+      ignore_breakers = pass == 1;
+      for (size_t i = 0; i < nodes_.size(); i++) {
+        auto stats = nodes_[i].stats.get();
+        usable[i] =
+            std::find(exclude.begin(), exclude.end(), stats) == exclude.end() &&
+            (ignore_breakers || !stats->Ejected());
+        usable_count += usable[i];
+      }
+    }
+    while (usable_count > 0) {
+      auto index = choose(n, usable);
+      // A half open node takes a single trial call at a time
+      if (ignore_breakers || nodes_[index].stats->Admit()) {
+        return &nodes_[index];
+      }
+      usable[index] = false;
+      usable_count--;
+    }
+    return nullptr;
+  }
+
+private:
+  size_t choose(uint64_t n, const std::vector<bool> &usable) {
+    switch (policy_) {
+    case BalancerPolicy::LeastStreams: {
+      // Start from the cursor so equally loaded nodes take turns
+      size_t best = nodes_.size();
+      for (size_t i = 0; i < nodes_.size(); i++) {
+        size_t candidate = (n + i) % nodes_.size();
+        if (usable[candidate] &&
+            (best == nodes_.size() ||
+             less_loaded(nodes_[candidate], nodes_[best]))) {
+          best = candidate;
+        }
+      }
+      return best;
+    }
+    case BalancerPolicy::PowerOfTwo: {
+      std::vector<size_t> candidates;
+      for (size_t i = 0; i < nodes_.size(); i++) {
+        if (usable[i]) {
+          candidates.push_back(i);
+        }
+      }
+      if (candidates.size() == 1) {
+        return candidates[0];
+      }
+      auto r = random();
+      size_t a = r % candidates.size();
+      size_t b =
+          (a + 1 + (r >> 32) % (candidates.size() - 1)) % candidates.size();
+      return less_loaded(nodes_[candidates[b]], nodes_[candidates[a]])
+                 ? candidates[b]
+                 : candidates[a];
+    }
+    default:
+      for (size_t i = 0; i < schedule_.size(); i++) {
+        auto index = schedule_[(n + i) % schedule_.size()];
+        if (usable[index]) {
+          return index;
+        }
+      }
+      return 0;
+    }
+  }
+};
+
+class HealthProber final {
+  // Active probes readmit ejected nodes before their ejection runs out. A
+  // node must answer a handshake with the sync byte, like for a real call,
+  // so one that only accepts connections stays ejected.
+  struct Attempt {
+    int fd;
+    std::shared_ptr<NodeStats> stats;
+    size_t sent = 0;
+    bool done = false;
+  };
+
+  NodeRegistry &registry_;
+  const int interval_ms_;
+  const int timeout_ms_;
+  const std::string handshake_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+  std::thread thread_;
+
+  // One step of an attempt, true once it is over either way
+  bool Step(Attempt &attempt, short revents) {
+    if (revents & (POLLERR | POLLNVAL)) {
+      return true;
+    }
+    if (attempt.sent < handshake_.size()) {
+      if (!(revents & POLLOUT)) {
+        return revents & POLLHUP;
+      }
+      auto n = send(attempt.fd, handshake_.data() + attempt.sent,
+                    handshake_.size() - attempt.sent, MSG_NOSIGNAL);
+      if (n < 0) {
+        return errno != EAGAIN && errno != EWOULDBLOCK;
+      }
+      attempt.sent += n;
+      return false;
+    }
+    uint8_t sync = 0;
+    auto n = recv(attempt.fd, &sync, 1, 0);
+    if (n == 1) {
+      attempt.stats->Readmit();
+      return true;
+    }
+    return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+
+  void Probe() {
+    auto nodes = registry_.All();
+    std::vector<Attempt> attempts;
+    for (auto &[key, stats] : nodes) {
+      if (stats->ejected_until_ms.load() == 0) {
+        continue;
+      }
+      // An address that changed may be why the node failed
+      stats->Resolve(key.first, key.second);
+      auto address = stats->Address();
+      std::string error;
+      int fd = address ? open_upstream_socket(*address, error) : -1;
+      if (fd >= 0) {
+        attempts.push_back(Attempt{fd, stats});
+      }
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms_);
+    std::vector<pollfd> fds(attempts.size());
+    size_t left = attempts.size();
+    while (left > 0) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (wait <= 0) {
+        break;
+      }
+      for (size_t i = 0; i < attempts.size(); i++) {
+        auto &attempt = attempts[i];
+        // Negative fds are skipped by poll
+        fds[i] = pollfd{attempt.done ? -1 : attempt.fd,
+                        short(attempt.sent < handshake_.size() ? POLLOUT
+                                                               : POLLIN),
+                        0};
+      }
+      int n = poll(fds.data(), fds.size(), int(wait));
+      if (n < 0 && errno != EINTR) {
+        break;
+      }
+      for (size_t i = 0; n > 0 && i < attempts.size(); i++) {
+        if (fds[i].revents && Step(attempts[i], fds[i].revents)) {
+          attempts[i].done = true;
+          left--;
+        }
+      }
+    }
+    for (auto &attempt : attempts) {
+      close(attempt.fd);
+    }
+  }
+
+public:
+  HealthProber(NodeRegistry &registry, int interval_ms, int timeout_ms,
+               std::string handshake)
+      : registry_(registry), interval_ms_(interval_ms), timeout_ms_(timeout_ms),
+        handshake_(std::move(handshake)) {
+    if (interval_ms_ <= 0) {
+      return;
+    }
+    thread_ = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!stop_) {
+        lock.unlock();
+        Probe();
+        lock.lock();
+        wake_.wait_for(lock, std::chrono::milliseconds(interval_ms_),
+                       [this]() { return stop_; });
+      }
+    });
+  }
+  HealthProber(const HealthProber &) = delete;
+  ~HealthProber() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+};
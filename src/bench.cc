@@ -0,0 +1,161 @@
+#include "pls.h"
+
+PLS_INCLUDE_HEADER_ONLY_CURRENT();
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <iostream>
+
+#include "bricks/dflags/dflags.h"
+#include "dsp.h"
+#include "loadgen.h"
+#include "ws_client.h"
+
+DEFINE_string(host, "127.0.0.1", "Router address");
+DEFINE_uint16(port, 8080, "Router websocket port");
+DEFINE_uint16(stub_port, 9001, "Port of the stub ASR node, 0 picks one");
+DEFINE_string(router, "",
+              "Router binary to start against the stub, empty uses a running "
+              "router routed to the stub");
+DEFINE_uint32(calls, 100, "Concurrent calls");
+DEFINE_uint32(frame_ms, 20, "Audio per frame in ms: 10, 20 or 40");
+DEFINE_double(speed, 1.0, "Pacing relative to real time, 0 sends unpaced");
+DEFINE_uint32(duration_sec, 10, "Audio streamed per call in seconds");
+DEFINE_uint32(audio_bytes_per_ms, 64, "Audio rate, 64 is 16kHz f32");
+DEFINE_uint32(threads, 4, "Sender threads");
+DEFINE_uint32(ramp_ms, 1000, "Time to open all the calls");
+DEFINE_string(selector, "", "Node selector sent in the handshake");
+DEFINE_uint32(channels, 1,
+              "Interleaved speakers per call, the router splits them");
+
+namespace {
+
+struct Call {
+  std::string id;
+  std::unique_ptr<WebsocketConnection> ws;
+  uint64_t connect_ns = 0;
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  ParseDFlags(&argc, &argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  StubAsrServer stub(FLAGS_stub_port);
+  pid_t router = 0;
+  if (!FLAGS_router.empty()) {
+    router = start_router(FLAGS_router, FLAGS_host, FLAGS_port, stub.Port());
+  }
+
+  // Frame size of a single speaker, whole float32 samples
+  const size_t frame_size =
+      std::max<size_t>(sizeof(LoadFrameHeader),
+                       FLAGS_frame_ms * FLAGS_audio_bytes_per_ms) /
+      sizeof(float) * sizeof(float);
+  const uint32_t channels = std::max(FLAGS_channels, 1u);
+  const uint32_t frames_per_call = FLAGS_duration_sec * 1000 / FLAGS_frame_ms;
+  const auto frame_interval = std::chrono::nanoseconds(
+      FLAGS_speed > 0 ? uint64_t(FLAGS_frame_ms * 1e6 / FLAGS_speed) : 0);
+
+  std::vector<Call> calls(FLAGS_calls);
+  std::atomic<uint64_t> sent_bytes{0};
+  std::atomic<uint64_t> failed_calls{0};
+  auto start = mono_ns();
+
+  // Every thread opens its share of calls over the ramp, then paces one frame
+  // per call per interval
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < FLAGS_threads; t++) {
+    threads.emplace_back([&, t]() {
+      std::vector<Call *> mine;
+      for (size_t i = t; i < calls.size(); i += FLAGS_threads) {
+        auto &call = calls[i];
+        call.id = "bench-" + std::to_string(i);
+        auto at = start + uint64_t(FLAGS_ramp_ms) * 1000000 * i / calls.size();
+        while (mono_ns() < at) {
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        try {
+          call.connect_ns = mono_ns();
+          call.ws = std::make_unique<WebsocketConnection>(FLAGS_host,
+                                                          FLAGS_port);
+          call.ws->SendText(
+              load_handshake(call.id, "bench", FLAGS_selector, channels));
+          mine.push_back(&call);
+        } catch (const std::runtime_error &e) {
+          std::cerr << call.id << ": " << e.what() << std::endl;
+          call.ws.reset();
+          failed_calls++;
+        }
+      }
+      // Every speaker stream gets the same stamped frame
+      std::string frame(frame_size, '\0');
+      std::string interleaved(frame_size * channels, '\0');
+      std::vector<const char *> speakers(channels, frame.data());
+      auto next = std::chrono::steady_clock::now();
+      for (uint32_t n = 0; n < frames_per_call && !mine.empty(); n++) {
+        for (auto it = mine.begin(); it != mine.end();) {
+          try {
+            stamp_load_frame(frame);
+            if (channels == 1) {
+              (*it)->ws->Send(frame.data(), frame.size());
+            } else {
+              interleave(speakers.data(), frame_size / sizeof(float),
+                         channels, sizeof(float), &interleaved[0]);
+              (*it)->ws->Send(interleaved.data(), interleaved.size());
+            }
+            sent_bytes += frame_size * channels;
+            ++it;
+          } catch (const std::runtime_error &e) {
+            std::cerr << (*it)->id << ": " << e.what() << std::endl;
+            failed_calls++;
+            it = mine.erase(it);
+          }
+        }
+        next += frame_interval;
+        std::this_thread::sleep_until(next);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto sent_ns = mono_ns() - start;
+
+  // Let the router drain its queues before reading the counters
+  for (uint64_t last = 0, idle = 0; stub.bytes < sent_bytes && idle < 5;) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    idle = stub.bytes == last ? idle + 1 : 0;
+    last = stub.bytes;
+  }
+  LatencyStats setup;
+  for (auto &call : calls) {
+    auto arrived = call.ws ? stub.HandshakeNs(call.id) : 0;
+    if (arrived > call.connect_ns) {
+      setup.Add(arrived - call.connect_ns);
+    }
+    if (call.ws) {
+      call.ws->Close();
+    }
+  }
+  if (router > 0) {
+    kill(router, SIGTERM);
+    waitpid(router, nullptr, 0);
+  }
+
+  auto seconds = sent_ns / 1e9;
+  std::cout << "calls " << FLAGS_calls << " x " << channels << " speakers, "
+            << FLAGS_frame_ms
+            << " ms frames of " << frame_size << " bytes, speed x"
+            << FLAGS_speed << ", failed " << failed_calls << std::endl;
+  std::cout << "sent " << sent_bytes << " bytes in " << seconds
+            << " s, forwarded " << stub.bytes << " bytes, " << stub.frames
+            << " frames, " << stub.bytes / seconds / 1e6 << " MB/s, "
+            << stub.frames / seconds << " frames/s" << std::endl;
+  std::cout << "forwarding latency: " << stub.latency.Summary() << std::endl;
+  std::cout << "setup latency: " << setup.Summary() << std::endl;
+  return failed_calls == 0 && stub.handshakes == FLAGS_calls * channels ? 0
+                                                                     : 1;
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+// Pooled, refcounted audio blocks. Frames are copied once from the websocket
+// buffer into a block and travel by reference up to the upstream socket.
+
+class FramePool;
+
+struct FrameBlock final {
+  static constexpr size_t kSize = 16 * 1024;
+  std::atomic<uint32_t> refs{0};
+  size_t size = 0;
+  char data[kSize];
+
+  size_t Free() const { return kSize - size; }
+};
+
+class FramePool final {
+  static constexpr size_t kCacheSize = 64;
+
+  std::mutex mutex_;
+  std::vector<FrameBlock *> free_;
+
+  struct Cache {
+    std::vector<FrameBlock *> blocks;
+    ~Cache() {
+      // Thread exit returns cached blocks to the shared list
+      FramePool::Instance().Return(blocks);
+    }
+  };
+  static Cache &LocalCache() {
+    thread_local Cache cache;
+    return cache;
+  }
+  void Return(std::vector<FrameBlock *> &blocks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.insert(free_.end(), blocks.begin(), blocks.end());
+    blocks.clear();
+  }
+
+public:
+  ~FramePool() {
+    for (auto block : free_) {
+      delete block;
+    }
+  }
+  static FramePool &Instance() {
+    static FramePool pool;
+    return pool;
+  }
+
+  FrameBlock *Acquire() {
+    auto &cache = LocalCache().blocks;
+    if (cache.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto n = std::min(free_.size(), kCacheSize / 2);
+      cache.insert(cache.end(), free_.end() - n, free_.end());
+      free_.resize(free_.size() - n);
+    }
+    FrameBlock *block;
+    if (cache.empty()) {
+      block = new FrameBlock();
+    } else {
+      block = cache.back();
+      cache.pop_back();
+    }
+    block->size = 0;
+    block->refs = 1;
+    return block;
+  }
+  void Release(FrameBlock *block) {
+    if (block->refs.fetch_sub(1) != 1) {
+      return;
+    }
+    auto &cache = LocalCache().blocks;
+    cache.push_back(block);
+    if (cache.size() > kCacheSize) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_.insert(free_.end(), cache.begin() + kCacheSize / 2, cache.end());
+      cache.resize(kCacheSize / 2);
+    }
+  }
+};
+
+class FrameRef final {
+  FrameBlock *block_ = nullptr;
+
+public:
+  FrameRef() = default;
+  static FrameRef Allocate() {
+    FrameRef ref;
+    ref.block_ = FramePool::Instance().Acquire();
+    return ref;
+  }
+  FrameRef(const FrameRef &rhs) : block_(rhs.block_) {
+    if (block_) {
+      block_->refs++;
+    }
+  }
+  FrameRef(FrameRef &&rhs) noexcept : block_(rhs.block_) {
+    rhs.block_ = nullptr;
+  }
+  FrameRef &operator=(FrameRef rhs) noexcept {
+    std::swap(block_, rhs.block_);
+    return *this;
+  }
+  ~FrameRef() { Reset(); }
+
+  void Reset() {
+    if (block_) {
+      FramePool::Instance().Release(block_);
+      block_ = nullptr;
+    }
+  }
+  explicit operator bool() const { return block_ != nullptr; }
+  FrameBlock *operator->() const { return block_; }
+  FrameBlock &operator*() const { return *block_; }
+};
+
+class FrameRing final {
+  // Fixed capacity queue of blocks, the slots never reallocate so readers may
+  // keep pointers into queued blocks while producers append
+  std::vector<FrameRef> slots_;
+  size_t head_ = 0;
+  size_t count_ = 0;
+
+public:
+  explicit FrameRing(size_t capacity) : slots_(std::max<size_t>(capacity, 2)) {}
+
+  bool Empty() const { return count_ == 0; }
+  size_t Count() const { return count_; }
+  FrameRef &At(size_t i) { return slots_[(head_ + i) % slots_.size()]; }
+  FrameRef &Front() { return At(0); }
+  FrameRef &Back() { return At(count_ - 1); }
+  bool Push(FrameRef block) {
+    if (count_ == slots_.size()) {
+      return false;
+    }
+    slots_[(head_ + count_) % slots_.size()] = std::move(block);
+    count_++;
+    return true;
+  }
+  void Pop() {
+    slots_[head_].Reset();
+    head_ = (head_ + 1) % slots_.size();
+    count_--;
+  }
+  void Clear() {
+    while (count_) {
+      Pop();
+    }
+  }
+  // Removes the block at position i, later blocks keep their order
+  void Erase(size_t i) {
+    for (; i + 1 < count_; i++) {
+      std::swap(At(i), At(i + 1));
+    }
+    Back().Reset();
+    count_--;
+  }
+  // Copies data into the tail blocks, new blocks come from the pool. A frame
+  // that fits a block is never split, so dropping whole blocks drops whole
+  // frames.
+  bool Append(const char *data, size_t size) {
+    if (!Empty() && size <= FrameBlock::kSize && Back()->Free() < size) {
+      if (!Push(FrameRef::Allocate())) {
+        return false;
+      }
+    }
+    while (size > 0) {
+      if (Empty() || Back()->Free() == 0) {
+        if (!Push(FrameRef::Allocate())) {
+          return false;
+        }
+      }
+      auto &tail = *Back();
+      auto n = std::min(size, tail.Free());
+      std::memcpy(tail.data + tail.size, data, n);
+      tail.size += n;
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+};
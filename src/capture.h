@@ -0,0 +1,290 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "buffers.h"
+#include "metrics.h"
+#include "tap.h"
+
+// Traffic capture for replay: the handshake and the arrival time and size
+// of every frame of a sample of calls, in one append only file. The router
+// hands records to a writer thread over a lock free queue, the replay tool
+// maps the file and walks it in arrival order.
+//
+//   CaptureFileHeader | (CaptureRecord | stored payload bytes)*
+//
+// Frame payloads are only stored when the audio is kept, replay otherwise
+// sends frames of the recorded sizes. Stored payloads are copied into pooled
+// frame blocks, a frame larger than a block keeps its record but not its
+// audio.
+
+#pragma pack(push, 1)
+struct CaptureFileHeader final {
+  static constexpr uint32_t kMagic = 0x54504356; // "VCPT"
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint32_t kFlagAudio = 1;
+  uint32_t magic;
+  uint32_t version;
+  uint32_t flags;
+  uint32_t reserved;
+  // Wall clock of at_ns 0
+  uint64_t start_unix_ms;
+};
+
+struct CaptureRecord final {
+  enum Kind : uint8_t { Open = 1, Frame = 2, Close = 3 };
+  // Arrival since the capture started
+  uint64_t at_ns;
+  uint32_t call;
+  uint8_t kind;
+  uint8_t reserved[3];
+  // Bytes of the websocket message, stored follow the record
+  uint32_t size;
+  uint32_t stored;
+};
+#pragma pack(pop)
+static_assert(sizeof(CaptureFileHeader) == 24, "capture header is 24 bytes");
+static_assert(sizeof(CaptureRecord) == 24, "capture record is 24 bytes");
+
+struct CaptureOptions {
+  // Empty disables the capture
+  std::string path;
+  bool audio = false;
+  // Fraction of calls captured, picked by call id
+  double sample = 1.0;
+  size_t queue_records = 1 << 16;
+};
+
+class CaptureWriter final {
+  struct Entry {
+    CaptureRecord record;
+    FrameRef payload;
+  };
+  static constexpr size_t kFlushBytes = 1 << 20;
+
+  const CaptureOptions options_;
+  const std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+  BoundedQueue<Entry> queue_;
+  std::atomic<uint32_t> next_call_{1};
+  std::atomic<bool> stop_{false};
+  int fd_ = -1;
+  std::thread thread_;
+
+  // False if the record was dropped
+  bool Push(uint32_t call, uint8_t kind, std::string_view data, bool store) {
+    if (store && data.size() > FrameBlock::kSize) {
+      dropped_audio.Add(1);
+      store = false;
+    }
+    Entry entry;
+    entry.record = CaptureRecord{
+        uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start_)
+                     .count()),
+        call,
+        kind,
+        {},
+        uint32_t(data.size()),
+        store ? uint32_t(data.size()) : 0};
+    if (store && !data.empty()) {
+      entry.payload = FrameRef::Allocate();
+      std::memcpy(entry.payload->data, data.data(), data.size());
+      entry.payload->size = data.size();
+    }
+    if (!queue_.Push(entry)) {
+      dropped_records.Add(1);
+      return false;
+    }
+    records.Add(1);
+    return true;
+  }
+
+  bool WriteAll(const std::string &buffer) {
+    size_t done = 0;
+    while (done < buffer.size()) {
+      auto n = write(fd_, buffer.data() + done, buffer.size() - done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        std::cout << "Capture: write failed: " << strerror(errno) << std::endl;
+        return false;
+      }
+      done += n;
+    }
+    bytes_written.Add(buffer.size());
+    return true;
+  }
+
+  void Run() {
+    std::string buffer;
+    buffer.reserve(kFlushBytes + 64 * 1024);
+    Entry entry;
+    while (true) {
+      bool stopping = stop_;
+      while (buffer.size() < kFlushBytes && queue_.Pop(entry)) {
+        buffer.append(reinterpret_cast<const char *>(&entry.record),
+                      sizeof(entry.record));
+        if (entry.payload) {
+          buffer.append(entry.payload->data, entry.payload->size);
+          entry.payload.Reset();
+        }
+      }
+      if (!buffer.empty()) {
+        WriteAll(buffer);
+        buffer.clear();
+        continue;
+      }
+      if (stopping) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+public:
+  ShardedCounter records;
+  ShardedCounter dropped_records;
+  // Frames recorded without their audio, too large for a block
+  ShardedCounter dropped_audio;
+  ShardedCounter bytes_written;
+
+  explicit CaptureWriter(CaptureOptions options)
+      : options_(std::move(options)),
+        queue_(!options_.path.empty() ? options_.queue_records : 2) {
+    if (options_.path.empty()) {
+      return;
+    }
+    fd_ = open(options_.path.c_str(),
+               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      std::cout << "Capture: can't open " << options_.path << ": "
+                << strerror(errno) << std::endl;
+      return;
+    }
+    CaptureFileHeader header{
+        CaptureFileHeader::kMagic, CaptureFileHeader::kVersion,
+        options_.audio ? CaptureFileHeader::kFlagAudio : 0, 0,
+        uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count())};
+    if (!WriteAll(std::string(reinterpret_cast<const char *>(&header),
+                              sizeof(header)))) {
+      close(fd_);
+      fd_ = -1;
+      return;
+    }
+    thread_ = std::thread([this]() { Run(); });
+    std::cout << "Capturing " << options_.sample * 100 << "% of calls to "
+              << options_.path << std::endl;
+  }
+  CaptureWriter(const CaptureWriter &) = delete;
+  ~CaptureWriter() {
+    if (thread_.joinable()) {
+      stop_ = true;
+      thread_.join();
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool Enabled() const { return fd_ >= 0; }
+
+  // Capture id of a new call, 0 if it is not captured or its handshake
+  // could not be recorded
+  uint32_t Open(const std::string &call_id, std::string_view handshake) {
+    if (!Enabled() ||
+        (options_.sample < 1.0 &&
+         double(std::hash<std::string>{}(call_id) % 10000) >=
+             options_.sample * 10000)) {
+      return 0;
+    }
+    auto call = next_call_.fetch_add(1, std::memory_order_relaxed);
+    if (handshake.size() > FrameBlock::kSize ||
+        !Push(call, CaptureRecord::Open, handshake, true)) {
+      return 0;
+    }
+    return call;
+  }
+  void Frame(uint32_t call, std::string_view data) {
+    Push(call, CaptureRecord::Frame, data, options_.audio);
+  }
+  void Close(uint32_t call) { Push(call, CaptureRecord::Close, {}, false); }
+};
+
+class CaptureFile final {
+  // Read only mapping of a capture, records are walked in file order which
+  // is arrival order up to the writer queue
+  int fd_ = -1;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+public:
+  explicit CaptureFile(const std::string &path) {
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) < 0 ||
+        size_t(st.st_size) < sizeof(CaptureFileHeader)) {
+      if (fd_ >= 0) {
+        close(fd_);
+      }
+      throw std::runtime_error("can't open capture " + path);
+    }
+    size_ = st.st_size;
+    auto memory = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (memory == MAP_FAILED) {
+      close(fd_);
+      throw std::runtime_error("can't map capture " + path);
+    }
+    data_ = static_cast<const char *>(memory);
+    madvise(memory, size_, MADV_SEQUENTIAL);
+    if (Header().magic != CaptureFileHeader::kMagic ||
+        Header().version != CaptureFileHeader::kVersion) {
+      munmap(memory, size_);
+      close(fd_);
+      throw std::runtime_error(path + " is not a vocallout capture");
+    }
+  }
+  CaptureFile(const CaptureFile &) = delete;
+  ~CaptureFile() {
+    munmap(const_cast<char *>(data_), size_);
+    close(fd_);
+  }
+
+  const CaptureFileHeader &Header() const {
+    return *reinterpret_cast<const CaptureFileHeader *>(data_);
+  }
+  size_t Size() const { return size_; }
+
+  // Calls f(record, payload) for every complete record, a record cut by a
+  // crash of the router ends the walk
+  template <typename F> void ForEach(F &&f) const {
+    size_t offset = sizeof(CaptureFileHeader);
+    while (offset + sizeof(CaptureRecord) <= size_) {
+      CaptureRecord record;
+      std::memcpy(&record, data_ + offset, sizeof(record));
+      offset += sizeof(record);
+      if (offset + record.stored > size_) {
+        break;
+      }
+      f(record, std::string_view(data_ + offset, record.stored));
+      offset += record.stored;
+    }
+  }
+};
@@ -0,0 +1,589 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Sample kernels of the audio path. Vector paths are picked at compile time,
+// scalar loops handle the tails and the other targets.
+
+// Speakers of a single multi channel call
+constexpr uint32_t kMaxAudioChannels = 8;
+
+// Stereo float32 (or any 32 bit sample), the common two party call layout
+inline void deinterleave2x32(const char *in, size_t frames, char *left,
+                             char *right) {
+  size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON)
+  auto src = reinterpret_cast<const float *>(in);
+  auto l = reinterpret_cast<float *>(left);
+  auto r = reinterpret_cast<float *>(right);
+#endif
+#if defined(__AVX2__)
+  for (; i + 8 <= frames; i += 8) {
+    auto a = _mm256_loadu_ps(src + 2 * i);
+    auto b = _mm256_loadu_ps(src + 2 * i + 8);
+    // Lane wise shuffles give L0 L1 L4 L5 | L2 L3 L6 L7, the permute fixes
+    // the 64 bit order
+    auto ls = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    auto rs = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm256_storeu_ps(l + i,
+                     _mm256_castpd_ps(_mm256_permute4x64_pd(
+                         _mm256_castps_pd(ls), _MM_SHUFFLE(3, 1, 2, 0))));
+    _mm256_storeu_ps(r + i,
+                     _mm256_castpd_ps(_mm256_permute4x64_pd(
+                         _mm256_castps_pd(rs), _MM_SHUFFLE(3, 1, 2, 0))));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= frames; i += 4) {
+    auto a = _mm_loadu_ps(src + 2 * i);
+    auto b = _mm_loadu_ps(src + 2 * i + 4);
+    _mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 4 <= frames; i += 4) {
+    auto v = vld2q_f32(src + 2 * i);
+    vst1q_f32(l + i, v.val[0]);
+    vst1q_f32(r + i, v.val[1]);
+  }
+#endif
+  for (; i < frames; i++) {
+    std::memcpy(left + 4 * i, in + 8 * i, 4);
+    std::memcpy(right + 4 * i, in + 8 * i + 4, 4);
+  }
+}
+
+// Splits frames of interleaved samples into one buffer per channel
+inline void deinterleave(const char *in, size_t frames, uint32_t channels,
+                         size_t sample_bytes, char *const *out) {
+  if (channels == 2 && sample_bytes == 4) {
+    deinterleave2x32(in, frames, out[0], out[1]);
+    return;
+  }
+  const size_t stride = channels * sample_bytes;
+  for (uint32_t c = 0; c < channels; c++) {
+    auto src = in + c * sample_bytes;
+    auto dst = out[c];
+    for (size_t i = 0; i < frames; i++) {
+      std::memcpy(dst + i * sample_bytes, src + i * stride, sample_bytes);
+    }
+  }
+}
+
+// Inverse of deinterleave, used by the load tools to build PBX like frames
+inline void interleave(const char *const *in, size_t frames, uint32_t channels,
+                       size_t sample_bytes, char *out) {
+  const size_t stride = channels * sample_bytes;
+  for (uint32_t c = 0; c < channels; c++) {
+    auto src = in[c];
+    auto dst = out + c * sample_bytes;
+    for (size_t i = 0; i < frames; i++) {
+      std::memcpy(dst + i * stride, src + i * sample_bytes, sample_bytes);
+    }
+  }
+}
+
+// G.711 decode tables, scaled to float32 in [-1, 1)
+inline const std::array<float, 256> &ulaw_table() {
+  static const std::array<float, 256> table = []() {
+    std::array<float, 256> t;
+    for (int i = 0; i < 256; i++) {
+      int u = ~i & 0xFF;
+      int v = (((u & 0x0F) << 3) + 0x84) << ((u & 0x70) >> 4);
+      t[i] = ((u & 0x80) ? (0x84 - v) : (v - 0x84)) / 32768.0f;
+    }
+    return t;
+  }();
+  return table;
+}
+inline const std::array<float, 256> &alaw_table() {
+  static const std::array<float, 256> table = []() {
+    std::array<float, 256> t;
+    for (int i = 0; i < 256; i++) {
+      int a = i ^ 0x55;
+      int v = (a & 0x0F) << 4;
+      int segment = (a & 0x70) >> 4;
+      if (segment == 0) {
+        v += 8;
+      } else {
+        v = (v + 0x108) << (segment - 1);
+      }
+      t[i] = ((a & 0x80) ? v : -v) / 32768.0f;
+    }
+    return t;
+  }();
+  return table;
+}
+
+inline void g711_to_f32(const std::array<float, 256> &table, const char *in,
+                        size_t n, float *out) {
+  auto src = reinterpret_cast<const uint8_t *>(in);
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= n; i += 8) {
+    int64_t bytes;
+    std::memcpy(&bytes, src + i, 8);
+    auto index = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(bytes));
+    _mm256_storeu_ps(out + i, _mm256_i32gather_ps(table.data(), index, 4));
+  }
+#endif
+  // Other targets: a table lookup per sample is already memory bound
+  for (; i < n; i++) {
+    out[i] = table[src[i]];
+  }
+}
+
+inline void s16_to_f32(const char *in, size_t n, float *out) {
+  size_t i = 0;
+  constexpr float kScale = 1.0f / 32768.0f;
+#if defined(__AVX2__)
+  auto scale = _mm256_set1_ps(kScale);
+  for (; i + 8 <= n; i += 8) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+                                                _mm256_cvtepi16_epi32(v)),
+                                            scale));
+  }
+#elif defined(__SSE2__)
+  auto scale = _mm_set1_ps(kScale);
+  for (; i + 8 <= n; i += 8) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i));
+    // Sign extend by placing the samples in the high halves
+    auto lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    auto hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= n; i += 8) {
+    auto v = vld1q_s16(reinterpret_cast<const int16_t *>(in + 2 * i));
+    vst1q_f32(out + i,
+              vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), kScale));
+    vst1q_f32(out + i + 4,
+              vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), kScale));
+  }
+#endif
+  for (; i < n; i++) {
+    int16_t sample;
+    std::memcpy(&sample, in + 2 * i, 2);
+    out[i] = sample * kScale;
+  }
+}
+
+// Saturating float32 to int16
+inline void f32_to_s16(const float *in, size_t n, char *out) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  auto scale = _mm256_set1_ps(32768.0f);
+  for (; i + 16 <= n; i += 16) {
+    auto a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale));
+    auto b =
+        _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale));
+    // packs works per 128 bit lane, restore the sample order
+    auto packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+                                           _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i), packed);
+  }
+#elif defined(__SSE2__)
+  auto scale = _mm_set1_ps(32768.0f);
+  for (; i + 8 <= n; i += 8) {
+    auto a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), scale));
+    auto b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i),
+                     _mm_packs_epi32(a, b));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 8 <= n; i += 8) {
+    auto a = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + i), 32768.0f));
+    auto b = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + i + 4), 32768.0f));
+    vst1q_s16(reinterpret_cast<int16_t *>(out + 2 * i),
+              vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+  }
+#endif
+  for (; i < n; i++) {
+    auto v = std::nearbyint(in[i] * 32768.0f);
+    int16_t sample = v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : v;
+    std::memcpy(out + 2 * i, &sample, 2);
+  }
+}
+
+// Averages interleaved channels into one
+inline void downmix(const float *in, size_t frames, uint32_t channels,
+                    float *out) {
+  size_t i = 0;
+  if (channels == 2) {
+#if defined(__AVX2__)
+    auto half = _mm256_set1_ps(0.5f);
+    for (; i + 8 <= frames; i += 8) {
+      auto a = _mm256_loadu_ps(in + 2 * i);
+      auto b = _mm256_loadu_ps(in + 2 * i + 8);
+      auto sum =
+          _mm256_add_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                        _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+      _mm256_storeu_ps(out + i, _mm256_castpd_ps(_mm256_permute4x64_pd(
+                                    _mm256_castps_pd(_mm256_mul_ps(sum, half)),
+                                    _MM_SHUFFLE(3, 1, 2, 0))));
+    }
+#elif defined(__SSE2__)
+    auto half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= frames; i += 4) {
+      auto a = _mm_loadu_ps(in + 2 * i);
+      auto b = _mm_loadu_ps(in + 2 * i + 4);
+      auto sum = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                            _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+      _mm_storeu_ps(out + i, _mm_mul_ps(sum, half));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= frames; i += 4) {
+      auto v = vld2q_f32(in + 2 * i);
+      vst1q_f32(out + i, vmulq_n_f32(vaddq_f32(v.val[0], v.val[1]), 0.5f));
+    }
+#endif
+  }
+  const float scale = 1.0f / channels;
+  for (; i < frames; i++) {
+    float sum = 0;
+    for (uint32_t c = 0; c < channels; c++) {
+      sum += in[i * channels + c];
+    }
+    out[i] = sum * scale;
+  }
+}
+
+// Sum of squares and sign changes between neighbours, inputs of the VAD
+inline void energy_zcr(const float *in, size_t n, float &energy,
+                       uint32_t &crossings) {
+  size_t i = 0;
+  float sum = 0;
+  uint32_t changes = 0;
+#if defined(__AVX2__)
+  auto acc = _mm256_setzero_ps();
+  for (; i + 9 <= n; i += 8) {
+    auto a = _mm256_loadu_ps(in + i);
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(a, a));
+    // Sign bits differ where the xor of the neighbours is negative
+    changes += __builtin_popcount(_mm256_movemask_ps(
+        _mm256_xor_ps(a, _mm256_loadu_ps(in + i + 1))));
+  }
+  std::array<float, 8> lanes;
+  _mm256_storeu_ps(lanes.data(), acc);
+  for (auto lane : lanes) {
+    sum += lane;
+  }
+#elif defined(__SSE2__)
+  auto acc = _mm_setzero_ps();
+  for (; i + 5 <= n; i += 4) {
+    auto a = _mm_loadu_ps(in + i);
+    acc = _mm_add_ps(acc, _mm_mul_ps(a, a));
+    changes += __builtin_popcount(
+        _mm_movemask_ps(_mm_xor_ps(a, _mm_loadu_ps(in + i + 1))));
+  }
+  std::array<float, 4> lanes;
+  _mm_storeu_ps(lanes.data(), acc);
+  for (auto lane : lanes) {
+    sum += lane;
+  }
+#elif defined(__ARM_NEON)
+  auto acc = vdupq_n_f32(0);
+  auto signs = vdupq_n_u32(0);
+  for (; i + 5 <= n; i += 4) {
+    auto a = vld1q_f32(in + i);
+    acc = vmlaq_f32(acc, a, a);
+    auto next = vld1q_f32(in + i + 1);
+    auto flips =
+        veorq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(next));
+    signs = vaddq_u32(signs, vshrq_n_u32(flips, 31));
+  }
+  std::array<float, 4> lanes;
+  std::array<uint32_t, 4> counts;
+  vst1q_f32(lanes.data(), acc);
+  vst1q_u32(counts.data(), signs);
+  for (size_t k = 0; k < 4; k++) {
+    sum += lanes[k];
+    changes += counts[k];
+  }
+#endif
+  for (; i < n; i++) {
+    sum += in[i] * in[i];
+    if (i + 1 < n && std::signbit(in[i]) != std::signbit(in[i + 1])) {
+      changes++;
+    }
+  }
+  energy = sum;
+  crossings = changes;
+}
+
+class Upsampler2x final {
+  // Polyphase half band interpolator: even outputs are the delayed input,
+  // odd outputs are a windowed sinc between two inputs. Delay is kTaps/2
+  // input samples.
+  static constexpr size_t kTaps = 32;
+  std::vector<float> buffer_ = std::vector<float>(kTaps - 1, 0.0f);
+
+  static const std::array<float, kTaps> &coefficients() {
+    static const std::array<float, kTaps> taps = []() {
+      std::array<float, kTaps> c;
+      const double pi = std::acos(-1.0);
+      double sum = 0;
+      for (size_t k = 0; k < kTaps; k++) {
+        double t = double(k) - kTaps / 2 + 0.5;
+        double window =
+            0.42 + 0.5 * std::cos(pi * t / (kTaps / 2)) +
+            0.08 * std::cos(2 * pi * t / (kTaps / 2)); // Blackman
+        c[k] = std::sin(pi * t) / (pi * t) * window;
+        sum += c[k];
+      }
+      for (auto &tap : c) {
+        tap /= sum;
+      }
+      return c;
+    }();
+    return taps;
+  }
+
+public:
+  // Writes 2 * n samples
+  void Process(const float *in, size_t n, float *out) {
+    auto &c = coefficients();
+    buffer_.insert(buffer_.end(), in, in + n);
+    const float *x = buffer_.data();
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+      auto odd = _mm256_setzero_ps();
+      for (size_t k = 0; k < kTaps; k++) {
+        odd = _mm256_add_ps(odd, _mm256_mul_ps(_mm256_set1_ps(c[k]),
+                                               _mm256_loadu_ps(x + i + k)));
+      }
+      auto even = _mm256_loadu_ps(x + i + kTaps / 2 - 1);
+      auto lo = _mm256_unpacklo_ps(even, odd);
+      auto hi = _mm256_unpackhi_ps(even, odd);
+      _mm256_storeu_ps(out + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+      _mm256_storeu_ps(out + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+      auto odd = _mm_setzero_ps();
+      for (size_t k = 0; k < kTaps; k++) {
+        auto tap = _mm_loadu_ps(x + i + k);
+        odd = _mm_add_ps(odd, _mm_mul_ps(_mm_set1_ps(c[k]), tap));
+      }
+      auto even = _mm_loadu_ps(x + i + kTaps / 2 - 1);
+      _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(even, odd));
+      _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(even, odd));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+      auto odd = vdupq_n_f32(0);
+      for (size_t k = 0; k < kTaps; k++) {
+        odd = vmlaq_n_f32(odd, vld1q_f32(x + i + k), c[k]);
+      }
+      float32x4x2_t pair = {{vld1q_f32(x + i + kTaps / 2 - 1), odd}};
+      vst2q_f32(out + 2 * i, pair);
+    }
+#endif
+    for (; i < n; i++) {
+      float odd = 0;
+      for (size_t k = 0; k < kTaps; k++) {
+        odd += c[k] * x[i + k];
+      }
+      out[2 * i] = x[i + kTaps / 2 - 1];
+      out[2 * i + 1] = odd;
+    }
+    buffer_.erase(buffer_.begin(), buffer_.begin() + n);
+  }
+};
+
+enum class SampleFormat { F32, S16, Ulaw, Alaw };
+
+inline bool parse_sample_format(const std::string &name,
+                                SampleFormat &format) {
+  if (name == "f32") {
+    format = SampleFormat::F32;
+  } else if (name == "s16") {
+    format = SampleFormat::S16;
+  } else if (name == "ulaw") {
+    format = SampleFormat::Ulaw;
+  } else if (name == "alaw") {
+    format = SampleFormat::Alaw;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline size_t sample_bytes(SampleFormat format) {
+  switch (format) {
+  case SampleFormat::F32:
+    return 4;
+  case SampleFormat::S16:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+class Transcoder final {
+  // Turns PBX audio (G.711, s16 or f32, 8 or 16 kHz, interleaved channels)
+  // into 16 kHz float32 streams: one per channel or a single downmix
+  const SampleFormat format_;
+  const uint32_t channels_;
+  const bool downmix_;
+  const bool upsample_;
+  std::string pending_;
+  std::vector<float> decoded_;
+  std::vector<float> mono_;
+  std::vector<std::vector<float>> split_;
+  std::vector<Upsampler2x> upsamplers_;
+
+public:
+  static constexpr uint32_t kOutputRate = 16000;
+
+  Transcoder(SampleFormat format, uint32_t rate, uint32_t channels,
+             bool downmix)
+      : format_(format), channels_(std::max(channels, 1u)),
+        downmix_(downmix && channels_ > 1), upsample_(rate == 8000) {
+    if (rate != 8000 && rate != kOutputRate) {
+      throw std::logic_error("unsupported sample rate " +
+                             std::to_string(rate));
+    }
+    if (channels_ > kMaxAudioChannels) {
+      throw std::logic_error("too many channels");
+    }
+    split_.resize(Outputs());
+    if (upsample_) {
+      upsamplers_.resize(Outputs());
+    }
+  }
+
+  uint32_t Outputs() const { return downmix_ ? 1 : channels_; }
+
+  // Converts the whole sample frames of in, a frame cut by the message
+  // boundary waits for the next call. out[i] gets float32 bytes of output i.
+  void Process(std::string_view in, std::vector<std::string> &out) {
+    const size_t frame_bytes = channels_ * sample_bytes(format_);
+    if (!pending_.empty()) {
+      pending_.append(in.data(), in.size());
+      in = pending_;
+    }
+    const size_t frames = in.size() / frame_bytes;
+    const size_t samples = frames * channels_;
+    out.resize(Outputs());
+
+    // Stereo float32 at 16 kHz splits straight into the output buffers
+    const float *interleaved = nullptr;
+    if (format_ == SampleFormat::F32 && !downmix_ && !upsample_) {
+      std::array<char *, kMaxAudioChannels> dst;
+      for (uint32_t c = 0; c < channels_; c++) {
+        out[c].resize(frames * sizeof(float));
+        dst[c] = &out[c][0];
+      }
+      deinterleave(in.data(), frames, channels_, sizeof(float), dst.data());
+    } else {
+      if (format_ == SampleFormat::F32) {
+        decoded_.resize(samples);
+        std::memcpy(decoded_.data(), in.data(), samples * sizeof(float));
+      } else if (format_ == SampleFormat::S16) {
+        decoded_.resize(samples);
+        s16_to_f32(in.data(), samples, decoded_.data());
+      } else {
+        decoded_.resize(samples);
+        g711_to_f32(format_ == SampleFormat::Ulaw ? ulaw_table() : alaw_table(),
+                    in.data(), samples, decoded_.data());
+      }
+      interleaved = decoded_.data();
+    }
+
+    if (interleaved) {
+      if (channels_ == 1) {
+        split_[0].assign(interleaved, interleaved + frames);
+      } else if (downmix_) {
+        split_[0].resize(frames);
+        downmix(interleaved, frames, channels_, split_[0].data());
+      } else {
+        std::array<char *, kMaxAudioChannels> dst;
+        for (uint32_t c = 0; c < channels_; c++) {
+          split_[c].resize(frames);
+          dst[c] = reinterpret_cast<char *>(split_[c].data());
+        }
+        deinterleave(reinterpret_cast<const char *>(interleaved), frames,
+                     channels_, sizeof(float), dst.data());
+      }
+      for (uint32_t o = 0; o < Outputs(); o++) {
+        auto &stage = split_[o];
+        if (upsample_) {
+          out[o].resize(2 * frames * sizeof(float));
+          upsamplers_[o].Process(stage.data(), frames,
+                                 reinterpret_cast<float *>(&out[o][0]));
+        } else {
+          out[o].assign(reinterpret_cast<const char *>(stage.data()),
+                        frames * sizeof(float));
+        }
+      }
+    }
+
+    if (pending_.empty()) {
+      pending_.assign(in.data() + frames * frame_bytes,
+                      in.size() - frames * frame_bytes);
+    } else {
+      pending_.erase(0, frames * frame_bytes);
+    }
+  }
+};
+
+class VoiceDetector final {
+  // Energy plus zero crossing rate on 10 ms windows of 16 kHz audio. Loud
+  // windows are voiced speech, quieter ones with many crossings are
+  // fricatives. The hangover keeps pauses between words flowing.
+  static constexpr size_t kWindow = 160;
+  static constexpr float kUnvoicedZcr = 0.25f;
+  const float threshold_;
+  const uint32_t hangover_windows_;
+  uint32_t hangover_ = 0;
+
+public:
+  VoiceDetector(double threshold_db, uint32_t hangover_ms)
+      : threshold_(float(std::pow(10.0, threshold_db / 10))),
+        hangover_windows_(hangover_ms / 10) {}
+
+  // False if the whole chunk is silence past the hangover
+  bool Active(const float *in, size_t n) {
+    bool voice = false;
+    size_t windows = 0;
+    for (size_t i = 0; i < n && !voice; i += kWindow, windows++) {
+      auto len = std::min(kWindow, n - i);
+      float energy;
+      uint32_t crossings;
+      energy_zcr(in + i, len, energy, crossings);
+      float mean = energy / len;
+      voice = mean > threshold_ ||
+              (mean > threshold_ * 0.1f && crossings > kUnvoicedZcr * len);
+    }
+    if (voice) {
+      hangover_ = hangover_windows_;
+      return true;
+    }
+    if (hangover_ > 0) {
+      hangover_ -= std::min<uint32_t>(hangover_, windows);
+      return true;
+    }
+    return false;
+  }
+};
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ws_client.h"
+
+// Building blocks of the router load tools: a stub ASR node that answers the
+// handshake and timestamps arrivals, and frames that carry their send time.
+
+inline uint64_t mono_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Every load frame starts with this header, the router forwards it untouched
+struct LoadFrameHeader final {
+  static constexpr uint32_t kMagic = 0x564F4C47; // "VOLG"
+  uint32_t magic;
+  uint32_t size; // whole frame, header included
+  uint64_t sent_ns;
+};
+
+inline void stamp_load_frame(std::string &frame) {
+  LoadFrameHeader header{LoadFrameHeader::kMagic, uint32_t(frame.size()),
+                         mono_ns()};
+  std::memcpy(&frame[0], &header, sizeof(header));
+}
+
+// Multi channel calls name their speakers by channel index
+inline std::string load_handshake(const std::string &call_id,
+                                  const std::string &account,
+                                  const std::string &selector,
+                                  uint32_t channels = 1) {
+  std::string speakers = "\"caller\"";
+  if (channels > 1) {
+    speakers.clear();
+    for (uint32_t c = 0; c < channels; c++) {
+      speakers += (c ? ",\"speaker" : "\"speaker") + std::to_string(c) + "\"";
+    }
+  }
+  auto json = "{\"call_id\":\"" + call_id + "\",\"speakers\":[" + speakers +
+              "],\"meta\":{\"account_id\":\"" + account +
+              "\",\"configuration_id\":\"load\"}";
+  if (!selector.empty()) {
+    json += ",\"node_selector\":\"" + selector + "\"";
+  }
+  if (channels > 1) {
+    json += ",\"channels\":" + std::to_string(channels);
+  }
+  return json + "}";
+}
+
+// call_id of a handshake without a JSON parser, empty if missing
+inline std::string handshake_call_id(const std::string &json) {
+  auto key = json.find("\"call_id\"");
+  if (key == std::string::npos) {
+    return "";
+  }
+  auto begin = json.find('"', json.find(':', key) + 1);
+  auto end = json.find('"', begin + 1);
+  if (begin == std::string::npos || end == std::string::npos) {
+    return "";
+  }
+  return json.substr(begin + 1, end - begin - 1);
+}
+
+// Starts the router binary with a config that routes everything to the
+// stub, returns once its websocket port accepts connections
+inline pid_t start_router(const std::string &binary, const std::string &host,
+                          uint16_t port, uint16_t stub_port) {
+  auto config = "/tmp/vocallout_load_" + std::to_string(getpid()) + ".json";
+  std::ofstream(config) << "{\"default\":[{\"host\":\"127.0.0.1\",\"port\":"
+                        << stub_port << "}]}";
+  auto pid = fork();
+  if (pid == 0) {
+    auto config_flag = "--config=" + config;
+    auto port_flag = "--port=" + std::to_string(port);
+    auto http_flag = "--http_port=" + std::to_string(port + 1);
+    execl(binary.c_str(), binary.c_str(), config_flag.c_str(),
+          port_flag.c_str(), http_flag.c_str(), nullptr);
+    _exit(127);
+  }
+  // Wait for the listener
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    try {
+      WebsocketConnection probe(host, port);
+      probe.Close();
+      return pid;
+    } catch (const std::runtime_error &) {
+    }
+  }
+  kill(pid, SIGTERM);
+  throw std::runtime_error("router did not start");
+}
+
+// User plus system cpu time of a process, 0 if it is gone
+inline double process_cpu_seconds(pid_t pid) {
+  std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  std::getline(file, stat);
+  // Fields after the command name, utime and stime are the 12th and 13th
+  auto end = stat.rfind(')');
+  if (end == std::string::npos) {
+    return 0;
+  }
+  std::istringstream fields(stat.substr(end + 2));
+  std::string field;
+  uint64_t ticks = 0;
+  for (int i = 1; i <= 13 && fields >> field; i++) {
+    if (i >= 12) {
+      ticks += std::stoull(field);
+    }
+  }
+  return double(ticks) / sysconf(_SC_CLK_TCK);
+}
+
+class LatencyStats final {
+  std::mutex mutex_;
+  std::vector<uint64_t> samples_;
+
+public:
+  void Add(uint64_t ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.push_back(ns);
+  }
+  void Add(const std::vector<uint64_t> &samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.insert(samples_.end(), samples.begin(), samples.end());
+  }
+  size_t Count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return samples_.size();
+  }
+  // Percentile in microseconds, p in [0, 1]
+  double Percentile(double p) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (samples_.empty()) {
+      return 0;
+    }
+    auto index = std::min(samples_.size() - 1, size_t(p * samples_.size()));
+    std::nth_element(samples_.begin(), samples_.begin() + index,
+                     samples_.end());
+    return samples_[index] / 1e3;
+  }
+  std::string Summary() {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "n=%zu p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus",
+             Count(), Percentile(0.5), Percentile(0.9), Percentile(0.99),
+             Percentile(0.999), Percentile(1));
+    return line;
+  }
+};
+
+class StubAsrServer final {
+  // Single epoll thread: reads the handshake JSON, answers the sync byte and
+  // parses load frames to measure forwarding latency
+  struct Peer {
+    bool handshaked = false;
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+    std::string handshake;
+    std::string buffer;
+  };
+
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  uint16_t port_ = 0;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+  std::map<int, Peer> peers_;
+  std::vector<uint64_t> pending_latency_;
+
+  std::mutex mutex_;
+  std::map<std::string, uint64_t> handshake_ns_;
+
+  // True once the bytes so far close the top level JSON object
+  static bool scan_json(Peer &peer, char c) {
+    peer.handshake += c;
+    if (peer.in_string) {
+      if (peer.escaped) {
+        peer.escaped = false;
+      } else if (c == '\\') {
+        peer.escaped = true;
+      } else if (c == '"') {
+        peer.in_string = false;
+      }
+      return false;
+    }
+    if (c == '"') {
+      peer.in_string = true;
+    } else if (c == '{') {
+      peer.depth++;
+    } else if (c == '}') {
+      return --peer.depth == 0;
+    }
+    return false;
+  }
+
+  void OnData(int fd, Peer &peer, const char *data, size_t size) {
+    auto now = mono_ns();
+    size_t i = 0;
+    while (!peer.handshaked && i < size) {
+      if (scan_json(peer, data[i++])) {
+        peer.handshaked = true;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          handshake_ns_[handshake_call_id(peer.handshake)] = now;
+        }
+        handshakes++;
+        char sync = 1;
+        (void)!send(fd, &sync, 1, MSG_NOSIGNAL);
+      }
+    }
+    if (i == size) {
+      return;
+    }
+    bytes += size - i;
+    peer.buffer.append(data + i, size - i);
+    size_t offset = 0;
+    while (peer.buffer.size() - offset >= sizeof(LoadFrameHeader)) {
+      LoadFrameHeader header;
+      std::memcpy(&header, peer.buffer.data() + offset, sizeof(header));
+      if (header.magic != LoadFrameHeader::kMagic ||
+          header.size < sizeof(header)) {
+        // Not a load frame stream, only count bytes
+        peer.buffer.clear();
+        return;
+      }
+      if (peer.buffer.size() - offset < header.size) {
+        break;
+      }
+      pending_latency_.push_back(now - header.sent_ns);
+      frames++;
+      offset += header.size;
+    }
+    peer.buffer.erase(0, offset);
+  }
+
+  void Run() {
+    epoll_event events[256];
+    char buffer[64 * 1024];
+    while (!stop_) {
+      int n = epoll_wait(epoll_fd_, events, 256, 50);
+      for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd_) {
+          int client;
+          while ((client = accept4(listen_fd_, nullptr, nullptr,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = client;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client, &ev);
+            peers_[client] = Peer();
+            connections++;
+          }
+          continue;
+        }
+        while (true) {
+          auto got = recv(fd, buffer, sizeof(buffer), 0);
+          if (got > 0) {
+            OnData(fd, peers_[fd], buffer, got);
+            continue;
+          }
+          if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            peers_.erase(fd);
+          }
+          break;
+        }
+      }
+      if (!pending_latency_.empty()) {
+        latency.Add(pending_latency_);
+        pending_latency_.clear();
+      }
+    }
+  }
+
+public:
+  std::atomic<uint64_t> connections{0};
+  std::atomic<uint64_t> handshakes{0};
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> bytes{0};
+  LatencyStats latency;
+
+  explicit StubAsrServer(uint16_t port) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+            0 ||
+        listen(listen_fd_, 4096) < 0) {
+      close(listen_fd_);
+      throw std::runtime_error("stub asr: can't listen on port " +
+                               std::to_string(port));
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&addr), &len);
+    port_ = ntohs(addr.sin_port);
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+    thread_ = std::thread([this]() { Run(); });
+  }
+  StubAsrServer(const StubAsrServer &) = delete;
+  ~StubAsrServer() {
+    stop_ = true;
+    thread_.join();
+    for (auto &[fd, peer] : peers_) {
+      close(fd);
+    }
+    close(epoll_fd_);
+    close(listen_fd_);
+  }
+
+  uint16_t Port() const { return port_; }
+
+  // Arrival time of the handshake of a call, 0 if not seen yet
+  uint64_t HandshakeNs(const std::string &call_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = handshake_ns_.find(call_id);
+    return it == handshake_ns_.end() ? 0 : it->second;
+  }
+};
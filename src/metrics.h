@@ -0,0 +1,171 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Hot path instrumentation: counters are striped across cache lines so
+// threads do not bounce a shared line, histograms use fixed buckets.
+
+class ShardedCounter final {
+  static constexpr size_t kShards = 16;
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> value{0};
+  };
+  std::array<Slot, kShards> slots_;
+
+  static size_t slot() {
+    thread_local size_t index =
+        std::hash<std::thread::id>{}(std::this_thread::get_id()) % kShards;
+    return index;
+  }
+
+public:
+  void Add(uint64_t value) {
+    slots_[slot()].value.fetch_add(value, std::memory_order_relaxed);
+  }
+  uint64_t Value() const {
+    uint64_t total = 0;
+    for (auto &slot : slots_) {
+      total += slot.value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+};
+
+class Histogram final {
+  // Bucket upper bounds in microseconds
+  static constexpr std::array<uint64_t, 15> kBounds = {
+      100,    250,    500,    1000,    2500,    5000,    10000,  25000,
+      50000,  100000, 250000, 500000, 1000000, 2500000, 5000000};
+  std::array<std::atomic<uint64_t>, kBounds.size() + 1> buckets_{};
+  std::atomic<uint64_t> sum_us_{0};
+
+public:
+  void Observe(uint64_t us) {
+    size_t i = 0;
+    while (i < kBounds.size() && us > kBounds[i]) {
+      i++;
+    }
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us_.fetch_add(us, std::memory_order_relaxed);
+  }
+  // Prometheus cumulative buckets, in seconds
+  void Write(std::ostringstream &out, const std::string &name) const {
+    uint64_t count = 0;
+    for (size_t i = 0; i < buckets_.size(); i++) {
+      count += buckets_[i].load(std::memory_order_relaxed);
+      out << name << "_bucket{le=\"";
+      if (i < kBounds.size()) {
+        out << double(kBounds[i]) / 1e6;
+      } else {
+        out << "+Inf";
+      }
+      out << "\"} " << count << "\n";
+    }
+    out << name << "_sum " << double(sum_us_.load()) / 1e6 << "\n";
+    out << name << "_count " << count << "\n";
+  }
+};
+
+enum class ErrorType : size_t {
+  HandshakeParse = 0,
+  NoNodes,
+  Connect,
+  Handshake,
+  Write,
+  UpstreamClosed,
+  Overflow,
+  Failover,
+  Draining,
+  RateLimited,
+  Count
+};
+
+inline const char *error_type_name(ErrorType type) {
+  static const char *names[] = {"handshake_parse", "no_nodes",
+                                "connect",         "handshake",
+                                "write",           "upstream_closed",
+                                "overflow",        "failover",
+                                "draining",        "rate_limited"};
+  return names[static_cast<size_t>(type)];
+}
+
+struct RouterMetrics final {
+  Histogram handshake_latency;
+  Histogram write_latency;
+  // Last audio sent to a node until its result line arrives, and the wait
+  // of that line in the router until the PBX gets it
+  Histogram result_latency;
+  Histogram result_relay_latency;
+  ShardedCounter results;
+  ShardedCounter results_dropped;
+  ShardedCounter frames;
+  ShardedCounter bytes;
+  // Pooled sockets found dead at handshake and replaced by a fresh connect
+  ShardedCounter pool_stale;
+  // Upstream audio replaced by silence markers
+  ShardedCounter vad_skipped_bytes;
+  std::array<ShardedCounter, static_cast<size_t>(ErrorType::Count)> errors;
+
+  void Error(ErrorType type) { errors[static_cast<size_t>(type)].Add(1); }
+
+  static RouterMetrics &Instance() {
+    static RouterMetrics metrics;
+    return metrics;
+  }
+};
+
+class PrometheusWriter final {
+  // Text exposition format 0.0.4, one family at a time
+  std::ostringstream out_;
+
+  static std::string escape(const std::string &value) {
+    std::string result;
+    for (auto c : value) {
+      if (c == '\\' || c == '"') {
+        result += '\\';
+      }
+      if (c == '\n') {
+        result += "\\n";
+        continue;
+      }
+      result += c;
+    }
+    return result;
+  }
+
+public:
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  void Family(const std::string &name, const std::string &type,
+              const std::string &help) {
+    out_ << "# HELP " << name << " " << help << "\n";
+    out_ << "# TYPE " << name << " " << type << "\n";
+  }
+  template <typename T>
+  void Sample(const std::string &name, const Labels &labels, T value) {
+    out_ << name;
+    if (!labels.empty()) {
+      out_ << "{";
+      for (size_t i = 0; i < labels.size(); i++) {
+        out_ << (i ? "," : "") << labels[i].first << "=\""
+             << escape(labels[i].second) << "\"";
+      }
+      out_ << "}";
+    }
+    out_ << " " << value << "\n";
+  }
+  void Histogram(const std::string &name, const std::string &help,
+                 const ::Histogram &histogram) {
+    Family(name, "histogram", help);
+    histogram.Write(out_, name);
+  }
+  std::string str() const { return out_.str(); }
+};
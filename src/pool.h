@@ -0,0 +1,339 @@
+#pragma once
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Pre-connected sockets to the ASR nodes. The handshake carries per call
+// metadata, so sockets are only warmed up to the TCP level.
+
+struct PoolOptions final {
+  size_t min_idle = 0; // 0 disables the pool
+  size_t max_idle = 8;
+  int check_interval_ms = 1000;
+  int max_idle_age_ms = 60000;
+  int connect_timeout_ms = 1000;
+  int backoff_min_ms = 100;
+  int backoff_max_ms = 10000;
+};
+
+// Address of a node, resolved once so connects on the call path never wait
+// for the resolver
+struct UpstreamAddress final {
+  sockaddr_storage addr{};
+  socklen_t len = 0;
+  int family = AF_UNSPEC;
+};
+
+// Blocking lookup, the first address of host is kept
+inline bool resolve_upstream(const std::string &host, uint16_t port,
+                             UpstreamAddress &address, std::string &error) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  addrinfo *result = nullptr;
+  auto service = std::to_string(port);
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0 ||
+      result == nullptr) {
+    error = "can't resolve " + host;
+    return false;
+  }
+  std::memcpy(&address.addr, result->ai_addr, result->ai_addrlen);
+  address.len = result->ai_addrlen;
+  address.family = result->ai_family;
+  freeaddrinfo(result);
+  return true;
+}
+
+// Non blocking connect, returns the socket or -1 and the reason
+inline int open_upstream_socket(const UpstreamAddress &address,
+                                std::string &error) {
+  int fd =
+      socket(address.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    error = std::string("socket: ") + std::strerror(errno);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&address.addr),
+              address.len) < 0 &&
+      errno != EINPROGRESS) {
+    error = std::string("connect: ") + std::strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Resolves and connects, for threads that serve no calls
+inline int open_upstream_socket(const std::string &host, uint16_t port,
+                                std::string &error) {
+  UpstreamAddress address;
+  if (!resolve_upstream(host, port, address, error)) {
+    return -1;
+  }
+  return open_upstream_socket(address, error);
+}
+
+class NodePool final {
+  using clock = std::chrono::steady_clock;
+  struct IdleSocket {
+    int fd;
+    clock::time_point since;
+  };
+
+  std::mutex mutex_;
+  std::deque<IdleSocket> idle_;
+  uint32_t failures_ = 0;
+  clock::time_point next_attempt_;
+
+  // The peer must neither have closed the socket nor sent anything before
+  // our handshake
+  static bool alive(int fd) {
+    char byte;
+    auto n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
+public:
+  const std::string host;
+  const uint16_t port;
+
+  NodePool(std::string host, uint16_t port)
+      : host(std::move(host)), port(port) {}
+  NodePool(const NodePool &) = delete;
+  ~NodePool() {
+    for (auto &socket : idle_) {
+      close(socket.fd);
+    }
+  }
+
+  int Take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!idle_.empty()) {
+      // Newest first, it is the least likely to be dropped by the peer
+      auto socket = idle_.back();
+      idle_.pop_back();
+      if (alive(socket.fd)) {
+        return socket.fd;
+      }
+      close(socket.fd);
+    }
+    return -1;
+  }
+
+  size_t Idle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+  }
+
+  // Drops dead and stale sockets, returns how many to open
+  size_t Check(const PoolOptions &options) {
+    auto now = clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto max_age = std::chrono::milliseconds(options.max_idle_age_ms);
+    for (auto it = idle_.begin(); it != idle_.end();) {
+      if (now - it->since > max_age || !alive(it->fd)) {
+        close(it->fd);
+        it = idle_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (now < next_attempt_ || idle_.size() >= options.min_idle) {
+      return 0;
+    }
+    return options.min_idle - idle_.size();
+  }
+
+  void Connected(int fd, const PoolOptions &options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failures_ = 0;
+    if (idle_.size() >= options.max_idle) {
+      close(fd);
+      return;
+    }
+    idle_.push_back(IdleSocket{fd, clock::now()});
+  }
+
+  void ConnectFailed(const PoolOptions &options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failures_ = std::min<uint32_t>(failures_ + 1, 16);
+    auto backoff = std::min<int64_t>(
+        options.backoff_max_ms, int64_t(options.backoff_min_ms)
+                                    << (failures_ - 1));
+    next_attempt_ = clock::now() + std::chrono::milliseconds(backoff);
+  }
+};
+
+class ConnectionPool final {
+  const PoolOptions options_;
+  std::shared_mutex mutex_;
+  std::map<std::pair<std::string, uint16_t>, std::shared_ptr<NodePool>> pools_;
+
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  bool refill_ = false;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+
+  // Opens the missing sockets of all nodes at once and waits for them with a
+  // single poll
+  void Refill() {
+    std::vector<std::shared_ptr<NodePool>> pools;
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      for (auto &[key, pool] : pools_) {
+        pools.push_back(pool);
+      }
+    }
+    std::vector<pollfd> fds;
+    std::vector<std::shared_ptr<NodePool>> owners;
+    for (auto &pool : pools) {
+      auto missing = pool->Check(options_);
+      for (size_t i = 0; i < missing; i++) {
+        std::string error;
+        int fd = open_upstream_socket(pool->host, pool->port, error);
+        if (fd < 0) {
+          pool->ConnectFailed(options_);
+          break;
+        }
+        fds.push_back(pollfd{fd, POLLOUT, 0});
+        owners.push_back(pool);
+      }
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(options_.connect_timeout_ms);
+    size_t pending = fds.size();
+    while (pending > 0 && !stop_) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (left <= 0 || poll(fds.data(), fds.size(), left) <= 0) {
+        break;
+      }
+      for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i].fd < 0 || fds[i].revents == 0) {
+          continue;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == 0 && !(fds[i].revents & (POLLERR | POLLHUP))) {
+          owners[i]->Connected(fds[i].fd, options_);
+        } else {
+          close(fds[i].fd);
+          owners[i]->ConnectFailed(options_);
+        }
+        fds[i].fd = -1;
+        pending--;
+      }
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (fds[i].fd >= 0) {
+        close(fds[i].fd);
+        owners[i]->ConnectFailed(options_);
+      }
+    }
+  }
+
+  void Run() {
+    while (!stop_) {
+      Refill();
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_.wait_for(lock,
+                     std::chrono::milliseconds(options_.check_interval_ms),
+                     [this]() { return refill_ || stop_; });
+      refill_ = false;
+    }
+  }
+
+public:
+  explicit ConnectionPool(PoolOptions options) : options_(options) {
+    if (options_.min_idle > 0) {
+      thread_ = std::thread([this]() { Run(); });
+    }
+  }
+  ConnectionPool(const ConnectionPool &) = delete;
+  ~ConnectionPool() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  bool Enabled() const { return options_.min_idle > 0; }
+
+  // Keeps pools for the given nodes only
+  void SetNodes(const std::vector<std::pair<std::string, uint16_t>> &nodes) {
+    if (!Enabled()) {
+      return;
+    }
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      std::map<std::pair<std::string, uint16_t>, std::shared_ptr<NodePool>>
+          pools;
+      for (auto &node : nodes) {
+        auto it = pools_.find(node);
+        pools[node] = it != pools_.end()
+                          ? it->second
+                          : std::make_shared<NodePool>(node.first, node.second);
+      }
+      pools_.swap(pools);
+    }
+    Wake();
+  }
+
+  // Returns a connected socket or -1 if none is warm
+  int Take(const std::string &host, uint16_t port) {
+    if (!Enabled()) {
+      return -1;
+    }
+    std::shared_ptr<NodePool> pool;
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      auto it = pools_.find(std::make_pair(host, port));
+      if (it == pools_.end()) {
+        return -1;
+      }
+      pool = it->second;
+    }
+    auto fd = pool->Take();
+    Wake();
+    return fd;
+  }
+
+  void Wake() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      refill_ = true;
+    }
+    wake_.notify_one();
+  }
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pool.h"
+
+// Push side of the redis sync. A dedicated pub/sub connection listens to
+// the config channel (publishers PUBLISH after SET) and to keyspace events
+// of the config key (needs notify-keyspace-events with K and $ or A on the
+// server), any event triggers an immediate resync.
+
+class RedisWatcher final {
+  const std::string host_;
+  const int port_;
+  const std::string user_;
+  const std::string pass_;
+  const std::string key_;
+  const std::function<void()> on_change_;
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> connected_{false};
+  std::thread thread_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+
+  static std::string command(const std::vector<std::string> &args) {
+    std::string out = "*" + std::to_string(args.size()) + "\r\n";
+    for (auto &arg : args) {
+      out += "$" + std::to_string(arg.size()) + "\r\n" + arg + "\r\n";
+    }
+    return out;
+  }
+
+public:
+  // One parsed RESP value, arrays keep their elements
+  struct Reply {
+    char type = 0;
+    std::string value;
+    std::vector<Reply> elements;
+  };
+
+  // Parses one value at pos, false if the buffer holds only part of it
+  static bool parse(const std::string &buffer, size_t &pos, Reply &reply) {
+    auto end = buffer.find("\r\n", pos);
+    if (end == std::string::npos) {
+      return false;
+    }
+    reply.type = buffer[pos];
+    auto line = buffer.substr(pos + 1, end - pos - 1);
+    size_t next = end + 2;
+    if (reply.type == '$') {
+      auto size = std::stol(line);
+      if (size >= 0) {
+        if (buffer.size() < next + size + 2) {
+          return false;
+        }
+        reply.value = buffer.substr(next, size);
+        next += size + 2;
+      }
+    } else if (reply.type == '*') {
+      auto count = std::stol(line);
+      reply.elements.resize(std::max(count, 0l));
+      for (auto &element : reply.elements) {
+        if (!parse(buffer, next, element)) {
+          return false;
+        }
+      }
+    } else {
+      reply.value = line;
+    }
+    pos = next;
+    return true;
+  }
+
+private:
+  // Blocking read of one reply, the socket timeout lets stop_ be checked
+  bool read_reply(int fd, std::string &buffer, Reply &reply) {
+    char chunk[4096];
+    while (!stop_) {
+      size_t pos = 0;
+      if (!buffer.empty()) {
+        Reply parsed;
+        if (parse(buffer, pos, parsed)) {
+          buffer.erase(0, pos);
+          reply = std::move(parsed);
+          return true;
+        }
+      }
+      auto n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n > 0) {
+        buffer.append(chunk, n);
+      } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                            errno != EINTR)) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  bool send_all(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      auto n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+
+  int open() {
+    std::string error;
+    int fd = open_upstream_socket(host_, port_, error);
+    if (fd < 0) {
+      std::cout << "Redis watch: " << error << std::endl;
+      return -1;
+    }
+    pollfd pfd{fd, POLLOUT, 0};
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (poll(&pfd, 1, 1000) != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+      close(fd);
+      return -1;
+    }
+    // Back to blocking with a receive timeout
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    timeval timeout{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+  }
+
+  // Runs one subscription until it breaks, true if it got subscribed
+  bool Session() {
+    int fd = open();
+    if (fd < 0) {
+      return false;
+    }
+    std::string buffer;
+    Reply reply;
+    bool ok = true;
+    if (!pass_.empty()) {
+      ok = send_all(fd, command({"AUTH", user_, pass_})) &&
+           read_reply(fd, buffer, reply) && reply.type != '-';
+    }
+    ok = ok &&
+         send_all(fd, command({"SUBSCRIBE", key_}) +
+                          command({"PSUBSCRIBE", "__keyspace@*__:" + key_}));
+    bool subscribed = false;
+    try {
+      while (ok && !stop_ && read_reply(fd, buffer, reply)) {
+        if (reply.type != '*' || reply.elements.empty()) {
+          continue;
+        }
+        auto &kind = reply.elements[0].value;
+        if (kind == "subscribe") {
+          // Updates published while we were away are picked up by a resync
+          connected_ = subscribed = true;
+          std::cout << "Redis watch subscribed" << std::endl;
+          on_change_();
+        } else if (kind == "message" || kind == "pmessage") {
+          on_change_();
+        }
+      }
+    } catch (const std::exception &e) {
+      // Malformed reply, start over on a new connection
+      std::cout << "Redis watch error: " << e.what() << std::endl;
+    }
+    connected_ = false;
+    close(fd);
+    return subscribed;
+  }
+
+public:
+  RedisWatcher(std::string host, int port, std::string user, std::string pass,
+               std::string key, std::function<void()> on_change)
+      : host_(std::move(host)), port_(port), user_(std::move(user)),
+        pass_(std::move(pass)), key_(std::move(key)),
+        on_change_(std::move(on_change)) {
+    thread_ = std::thread([this]() {
+      int backoff_ms = 100;
+      while (!stop_) {
+        if (Session()) {
+          backoff_ms = 100;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait_for(lock, std::chrono::milliseconds(backoff_ms),
+                       [this]() { return stop_.load(); });
+        backoff_ms = std::min(backoff_ms * 2, 10000);
+      }
+    });
+  }
+  RedisWatcher(const RedisWatcher &) = delete;
+  ~RedisWatcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+  }
+
+  // False while the subscription is down, the caller polls meanwhile
+  bool Connected() const { return connected_; }
+};
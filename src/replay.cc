@@ -0,0 +1,196 @@
+#include "pls.h"
+
+PLS_INCLUDE_HEADER_ONLY_CURRENT();
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <iostream>
+
+#include "bricks/dflags/dflags.h"
+#include "capture.h"
+#include "loadgen.h"
+#include "ws_client.h"
+
+DEFINE_string(capture, "", "Capture file recorded with --capture_file");
+DEFINE_string(host, "127.0.0.1", "Router address");
+DEFINE_uint16(port, 8080, "Router websocket port");
+DEFINE_uint16(stub_port, 9001, "Port of the stub ASR node, 0 picks one");
+DEFINE_string(router, "",
+              "Router binary to start against the stub, empty uses a running "
+              "router routed to the stub");
+DEFINE_double(speed, 1.0, "Time compression of the capture, 0 sends unpaced");
+DEFINE_uint32(threads, 4, "Sender threads");
+DEFINE_uint32(max_calls, 0, "Calls replayed from the start, 0 replays all");
+
+namespace {
+
+struct Call {
+  std::string id;
+  std::string handshake;
+  std::unique_ptr<WebsocketConnection> ws;
+  uint64_t connect_ns = 0;
+  bool closed = false;
+};
+
+// One step of a sender thread, payload points into the mapped capture
+struct Event {
+  uint64_t at_ns;
+  uint32_t call;
+  uint8_t kind;
+  uint32_t size;
+  std::string_view payload;
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  ParseDFlags(&argc, &argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  CaptureFile capture(FLAGS_capture);
+  const uint32_t threads_count = std::max(FLAGS_threads, 1u);
+
+  // Calls are numbered in handshake order and spread over the threads, each
+  // thread replays its calls in arrival order
+  std::vector<Call> calls;
+  std::unordered_map<uint32_t, uint32_t> index;
+  std::vector<std::vector<Event>> schedules(threads_count);
+  uint64_t capture_ns = 0;
+  capture.ForEach([&](const CaptureRecord &record, std::string_view payload) {
+    auto it = index.find(record.call);
+    if (record.kind == CaptureRecord::Open) {
+      if (it != index.end() ||
+          (FLAGS_max_calls && calls.size() >= FLAGS_max_calls)) {
+        return;
+      }
+      it = index.emplace(record.call, uint32_t(calls.size())).first;
+      calls.emplace_back();
+      calls.back().handshake.assign(payload.data(), payload.size());
+      calls.back().id = handshake_call_id(calls.back().handshake);
+    } else if (it == index.end()) {
+      // Its handshake was dropped by the writer or cut by max_calls
+      return;
+    }
+    schedules[it->second % threads_count].push_back(
+        Event{record.at_ns, it->second, record.kind, record.size, payload});
+    capture_ns = std::max(capture_ns, record.at_ns);
+  });
+  for (auto &schedule : schedules) {
+    // The writer queue may swap records of different calls
+    std::stable_sort(schedule.begin(), schedule.end(),
+                     [](auto &a, auto &b) { return a.at_ns < b.at_ns; });
+  }
+  const bool audio = capture.Header().flags & CaptureFileHeader::kFlagAudio;
+  std::cout << "capture " << FLAGS_capture << ": " << calls.size()
+            << " calls over " << capture_ns / 1e9 << " s, "
+            << (audio ? "with" : "without") << " audio" << std::endl;
+
+  StubAsrServer stub(FLAGS_stub_port);
+  pid_t router = 0;
+  if (!FLAGS_router.empty()) {
+    router = start_router(FLAGS_router, FLAGS_host, FLAGS_port, stub.Port());
+  }
+  const double cpu_start = router > 0 ? process_cpu_seconds(router) : 0;
+
+  std::atomic<uint64_t> sent_bytes{0};
+  std::atomic<uint64_t> sent_frames{0};
+  std::atomic<uint64_t> failed_calls{0};
+  // How late events went out against the schedule
+  LatencyStats lag;
+  auto start = mono_ns();
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < threads_count; t++) {
+    threads.emplace_back([&, t]() {
+      std::string frame;
+      std::vector<uint64_t> lags;
+      lags.reserve(schedules[t].size());
+      for (auto &event : schedules[t]) {
+        auto at = start + (FLAGS_speed > 0
+                               ? uint64_t(double(event.at_ns) / FLAGS_speed)
+                               : 0);
+        auto now = mono_ns();
+        if (now < at) {
+          std::this_thread::sleep_for(std::chrono::nanoseconds(at - now));
+          now = mono_ns();
+        }
+        lags.push_back(now - std::min(now, at));
+        auto &call = calls[event.call];
+        try {
+          if (event.kind == CaptureRecord::Open) {
+            call.connect_ns = now;
+            call.ws = std::make_unique<WebsocketConnection>(FLAGS_host,
+                                                            FLAGS_port);
+            call.ws->SendText(call.handshake);
+          } else if (event.kind == CaptureRecord::Frame && call.ws) {
+            // Recorded audio or silence of the recorded size, stamped when
+            // it fits so the stub measures forwarding latency
+            frame.assign(event.payload.data(), event.payload.size());
+            frame.resize(event.size, '\0');
+            if (frame.size() >= sizeof(LoadFrameHeader)) {
+              stamp_load_frame(frame);
+            }
+            call.ws->Send(frame.data(), frame.size());
+            sent_bytes += frame.size();
+            sent_frames++;
+          } else if (event.kind == CaptureRecord::Close && call.ws) {
+            call.ws->Close();
+            call.closed = true;
+          }
+        } catch (const std::runtime_error &e) {
+          std::cerr << call.id << ": " << e.what() << std::endl;
+          call.ws.reset();
+          failed_calls++;
+        }
+      }
+      lag.Add(lags);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto sent_ns = mono_ns() - start;
+
+  // Let the router drain its queues before reading the counters
+  for (uint64_t last = 0, idle = 0; stub.bytes < sent_bytes && idle < 5;) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    idle = stub.bytes == last ? idle + 1 : 0;
+    last = stub.bytes;
+  }
+  double router_cpu = 0;
+  if (router > 0) {
+    router_cpu = process_cpu_seconds(router) - cpu_start;
+  }
+  LatencyStats setup;
+  for (auto &call : calls) {
+    auto arrived = call.ws ? stub.HandshakeNs(call.id) : 0;
+    if (arrived > call.connect_ns) {
+      setup.Add(arrived - call.connect_ns);
+    }
+    if (call.ws && !call.closed) {
+      call.ws->Close();
+    }
+  }
+  if (router > 0) {
+    kill(router, SIGTERM);
+    waitpid(router, nullptr, 0);
+  }
+
+  auto seconds = sent_ns / 1e9;
+  std::cout << "replayed " << calls.size() << " calls at speed x"
+            << FLAGS_speed << " in " << seconds << " s, failed "
+            << failed_calls << std::endl;
+  std::cout << "sent " << sent_frames << " frames, " << sent_bytes
+            << " bytes, forwarded " << stub.bytes << " bytes, "
+            << stub.frames << " stamped frames" << std::endl;
+  std::cout << "schedule lag: " << lag.Summary() << std::endl;
+  std::cout << "forwarding latency: " << stub.latency.Summary() << std::endl;
+  std::cout << "setup latency: " << setup.Summary() << std::endl;
+  if (router > 0 && !calls.empty()) {
+    std::cout << "router cpu " << router_cpu << " s, "
+              << router_cpu * 1e3 / calls.size() << " ms per call"
+              << std::endl;
+  }
+  return failed_calls == 0 ? 0 : 1;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "redis.h"
+#include "redis_watch.h"
 #include "vocallout.h"
 
 class RedisSync {
@@ -8,6 +9,8 @@ class RedisSync {
 protected:
   const std::string redis_key = "vocallout_config";
   RedisClient db_;
+  size_t last_hash_ = 0;
+  std::map<std::string, TenantLimits> limits_;
 
 public:
   explicit RedisSync() : db_("0.0.0.0", 6379, "default", "pass") {}
@@ -15,6 +18,12 @@ public:
                      std::string pass)
       : db_(RedisClient(host, port, user, pass)) {}
 
+  const std::string &Key() const { return redis_key; }
+  // Tenant limits of the last successful sync
+  const std::map<std::string, TenantLimits> &Limits() const { return limits_; }
+
+  // Returns the parsed config only when its content changed since the last
+  // successful sync
   std::pair<bool, std::map<std::string, std::vector<VONode>>> sync() {
     auto reply = db_.SendCommand("get " + redis_key);
     if (!reply.IsOK() || !reply.IsString()) {
@@ -22,103 +31,538 @@ public:
       return std::make_pair(false,
                             std::map<std::string, std::vector<VONode>>{});
     }
+    auto hash = std::hash<std::string>{}(reply.string);
+    if (hash == last_hash_) {
+      return std::make_pair(false,
+                            std::map<std::string, std::vector<VONode>>{});
+    }
     auto result = parse_config(reply.string);
-    if (!result.first) {
+    auto limits = parse_limits(reply.string);
+    if (!result.first || !limits.first) {
       std::cout << "Failed to parse config" << std::endl;
       return std::make_pair(false,
                             std::map<std::string, std::vector<VONode>>{});
     }
+    last_hash_ = hash;
+    limits_ = std::move(limits.second);
     return result;
   }
 };
 
+class ResultRelay final {
+  // Pushes node results to the PBX as they arrive instead of with the next
+  // audio frame, with --push_results. Upstream loops queue the channels that
+  // got results, one thread sends them under the channel lock, so writes to
+  // a client stay serialized with the router's callbacks. Writes made by
+  // the websockets library itself are not covered by that lock.
+  using Relay = std::function<void(Channel &)>;
+  const Relay relay_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::set<std::weak_ptr<Channel>, std::owner_less<std::weak_ptr<Channel>>>
+      pending_;
+  bool stop_ = false;
+  std::thread thread_;
+
+  void Run() {
+    std::vector<std::weak_ptr<Channel>> batch;
+    std::vector<std::weak_ptr<Channel>> busy;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto ready = [this]() { return stop_ || !pending_.empty(); };
+        if (busy.empty()) {
+          wake_.wait(lock, ready);
+        } else {
+          // Channels in a frame callback are retried shortly
+          wake_.wait_for(lock, std::chrono::milliseconds(1), ready);
+        }
+        if (stop_) {
+          break;
+        }
+        batch.assign(pending_.begin(), pending_.end());
+        pending_.clear();
+      }
+      batch.insert(batch.end(), busy.begin(), busy.end());
+      busy.clear();
+      for (auto &weak : batch) {
+        auto channel = weak.lock();
+        if (!channel) {
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(channel->mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+          busy.push_back(weak);
+          continue;
+        }
+        relay_(*channel);
+      }
+      batch.clear();
+    }
+  }
+
+public:
+  explicit ResultRelay(Relay relay)
+      : relay_(std::move(relay)), thread_([this]() { Run(); }) {}
+  ResultRelay(const ResultRelay &) = delete;
+  ~ResultRelay() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+  }
+
+  // Called by the upstream loops, never blocks on a channel
+  void Notify(const std::weak_ptr<Channel> &channel) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.insert(channel);
+    }
+    wake_.notify_one();
+  }
+};
+
 class StreamRouter {
 private:
+  // Polling only backs up the redis subscription
   const int redis_delay_ms_ = 1000;
-  current::WaitableAtomic<SharedState> safe_state_;
+  const int redis_fallback_ms_ = 30000;
+  std::mutex redis_mutex_;
+  std::condition_variable redis_wake_;
+  bool redis_pending_ = true;
+  std::mutex drain_mutex_;
+  std::chrono::steady_clock::time_point drain_deadline_;
+  SharedState state_;
   WSConfig ws_config_;
+  RouterSettings settings_;
+  AudioTap tap_;
+  CaptureWriter capture_;
+  UpstreamEngine upstream_;
+  HealthProber prober_;
   WebsocketServer server_;
+  // Declared last so it stops before the server goes away
+  ResultRelay relay_;
+
+  static BalancerPolicy balancer_policy(const std::string &name) {
+    BalancerPolicy policy = BalancerPolicy::RoundRobin;
+    if (!parse_balancer_policy(name, policy)) {
+      std::cout << "Unknown balancer '" << name << "', using round_robin"
+                << std::endl;
+    }
+    return policy;
+  }
+  static UpstreamOptions upstream_options(const WSConfig &config,
+                                          const RouterSettings &settings) {
+    auto &upstream = settings.upstream;
+    auto &balancer = settings.balancer;
+    UpstreamOptions options;
+    options.threads = upstream.threads;
+    options.max_queue_bytes = size_t(upstream.buffer_ms) *
+                              std::max(upstream.audio_bytes_per_ms, 1u);
+    if (!parse_overflow_policy(upstream.overflow_policy, options.overflow)) {
+      std::cout << "Unknown overflow policy '" << upstream.overflow_policy
+                << "', using disconnect" << std::endl;
+    }
+    options.connect_timeout_ms = config.timeout_write_sec * 1000;
+    options.handshake_timeout_ms = config.timeout_read_sec * 1000;
+    options.write_timeout_ms = config.timeout_write_sec * 1000;
+    options.batch_delay_ms = upstream.batch_ms;
+    options.max_result_bytes = upstream.result_queue_bytes;
+    options.breaker.failures = std::max(balancer.breaker_failures, 1u);
+    options.breaker.eject_ms = balancer.breaker_eject_ms;
+    options.breaker.max_eject_ms =
+        std::max(balancer.breaker_eject_ms * 12, balancer.breaker_eject_ms);
+    options.breaker.slow_handshake_ms = balancer.slow_handshake_ms;
+    return options;
+  }
+  static CaptureOptions capture_options(CaptureOptions options) {
+    // Workers write their own file
+    if (!options.path.empty() && SharedCounters::WorkerIndex() >= 0) {
+      options.path += "." + std::to_string(SharedCounters::WorkerIndex());
+    }
+    return options;
+  }
+  // Handshake of the health probes, nodes treat it as a short empty call
+  static std::string probe_handshake() {
+    VOHandshakeMessage handshake;
+    handshake.call_id = "vocallout-probe";
+    handshake.meta.account_id = "vocallout";
+    handshake.meta.configuration_id = "probe";
+    return JSON(handshake);
+  }
+  // Silence markers need a framed wire format, raw f32 nodes get every frame
+  void check_vad() {
+    if (settings_.vad.enabled && !state_.routing.AnyFramed()) {
+      std::cout << "warning: --vad is enabled but no node takes a framed "
+                   "wire_format (s16, ulaw), silence is forwarded as is"
+                << std::endl;
+    }
+  }
+  static PoolOptions pool_options(const WSConfig &config,
+                                  const UpstreamSettings &upstream) {
+    PoolOptions options;
+    options.min_idle = upstream.pool_min_idle;
+    options.max_idle = std::max(upstream.pool_max_idle, upstream.pool_min_idle);
+    options.check_interval_ms = upstream.pool_check_ms;
+    options.connect_timeout_ms = config.timeout_write_sec * 1000;
+    return options;
+  }
+
+  // Without --push_results results wait for the next client callback
+  std::function<void()> result_notify(Channel &channel) {
+    if (!settings_.upstream.push_results) {
+      return nullptr;
+    }
+    return [this, weak = channel.weak_from_this()]() { relay_.Notify(weak); };
+  }
+
+  // Moves the leg to the next untried node of its selector. The handshake
+  // is built for the wire format of the first node, failover reuses it.
+  void connect_upstream(
+      Channel &channel, ChannelLeg &leg,
+      const std::function<std::string(WireFormat)> &handshake = nullptr) {
+    while (true) {
+      auto node =
+          state_.routing.next_node(channel.node_selector, leg.tried_nodes);
+      leg.tried_nodes.push_back(node.stats.get());
+      if (leg.encoder && leg.encoder->Format() != node.wire_format) {
+        // Queued frames are already encoded for the first node
+        continue;
+      }
+      // Connect and handshake run on the upstream loop, audio frames are
+      // queued until the sync byte arrives
+      auto conn = leg.conn ? upstream_.Reconnect(*leg.conn, node.host,
+                                                 node.port, node.stats)
+                           : upstream_.Connect(node.host, node.port,
+                                               handshake(node.wire_format),
+                                               node.stats, channel.trace_id,
+                                               result_notify(channel));
+      if (!leg.encoder) {
+        leg.encoder = std::make_unique<WireEncoder>(node.wire_format);
+      }
+      if (leg.node_stats) {
+        leg.node_stats->StreamClosed();
+      }
+      leg.node_stats = node.stats;
+      node.stats->StreamOpened();
+      leg.conn = conn;
+      if (!conn->Failed()) {
+        return;
+      }
+      std::cout << "error: " << conn->Error() << std::endl;
+      if (std::chrono::steady_clock::now() > channel.failover_deadline) {
+        throw std::logic_error("failover deadline exceeded");
+      }
+    }
+  }
+
+  // Queues audio of one leg, false if the call has to be dropped
+  bool forward(Channel &channel, ChannelLeg &leg, std::string_view data) {
+    if (leg.conn->Failed() && !leg.conn->Handshaked() &&
+        std::chrono::steady_clock::now() < channel.failover_deadline) {
+      // The node never took the call, retry without dropping the PBX
+      std::cout << "error: " << leg.conn->Error() << ", failing over "
+                << channel.id << std::endl;
+      RouterMetrics::Instance().Error(ErrorType::Failover);
+      connect_upstream(channel, leg);
+    }
+    if (leg.tap) {
+      tap_.Write(leg.tap, data);
+    }
+    std::string_view wire;
+    if (leg.vad) {
+      // The detector reads the samples the encoder realigned, a message
+      // may end inside a sample
+      auto &samples = leg.encoder->Take(data);
+      if (leg.vad->Active(samples.data(), samples.size())) {
+        wire = leg.encoder->EncodeTaken();
+      } else {
+        wire = leg.encoder->SkipTaken();
+        RouterMetrics::Instance().vad_skipped_bytes.Add(data.size());
+      }
+    } else {
+      wire = leg.encoder->Encode(data);
+    }
+    if (wire.empty()) {
+      return true;
+    }
+    if (!leg.conn->Send(wire)) {
+      std::cout << "error: " << leg.conn->Error() << std::endl;
+      return false;
+    }
+    leg.node_stats->frames.Add(1);
+    leg.node_stats->bytes.Add(wire.size());
+    return true;
+  }
+
+  // Converts PBX audio to 16 kHz float32 and splits the speakers, a sample
+  // frame cut by the websocket message boundary waits for the next message
+  bool forward_transcoded(Channel &channel, std::string_view data) {
+    channel.transcoder->Process(data, channel.split);
+    for (size_t i = 0; i < channel.legs.size(); i++) {
+      if (!channel.split[i].empty() &&
+          !forward(channel, channel.legs[i], channel.split[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Audio is charged to the tenant buckets about every 100 ms of 16 kHz
+  // float32 so calls of one tenant rarely contend on them
+  void charge_limits(Channel &channel, size_t bytes) {
+    static constexpr uint64_t kChargeBytes = 6400;
+    channel.uncharged_bytes += bytes;
+    if (channel.uncharged_bytes < kChargeBytes) {
+      return;
+    }
+    auto now = limit_clock_ns();
+    for (auto &limiter : channel.limiters) {
+      limiter->Charge(channel.uncharged_bytes, now);
+    }
+    channel.uncharged_bytes = 0;
+  }
+
+  // Text message to the PBX, the only write the router makes on a client.
+  // Called from the client callbacks, and from the relay thread only with
+  // --push_results.
+  static void send_text(WebsocketClient &client, const std::string &text) {
+    client.Send(text);
+  }
+
+  // Sends the queued node results back over the call websocket, with the
+  // channel mutex held
+  void relay_results(Channel &channel) {
+    if (channel.closed || !channel.client) {
+      return;
+    }
+    thread_local std::vector<
+        std::pair<std::string, std::chrono::steady_clock::time_point>>
+        results;
+    auto &metrics = RouterMetrics::Instance();
+    for (auto &leg : channel.legs) {
+      if (!leg.conn || !leg.conn->TakeResults(results)) {
+        continue;
+      }
+      auto now = std::chrono::steady_clock::now();
+      for (auto &[text, received] : results) {
+        send_text(*channel.client, text);
+        metrics.result_relay_latency.Observe(
+            std::chrono::duration_cast<std::chrono::microseconds>(now -
+                                                                  received)
+                .count());
+      }
+      metrics.results.Add(results.size());
+      results.clear();
+    }
+  }
 
   void on_connect(WebsocketClient &client) {
     auto id = client.Address() + ":" + client.Port();
-    safe_state_.MutableUse([&id](SharedState &state) {
-      state.channel_states[id] = 0;
-      std::cout << "Client " << id << " connected" << std::endl;
-    });
+    auto channel = state_.channels.Add(channel_handle(client), id);
+    channel->client = &client;
+    std::cout << "Client " << id << " connected" << std::endl;
   }
   void on_disconnect(WebsocketClient &client) {
-    auto id = client.Address() + ":" + client.Port();
-    safe_state_.MutableUse([&id](SharedState &state) {
-      // close the connection and clean buffers
-      state.channel_states.erase(id);
-      state.channels.erase(id);
-      std::cout << "Client " << id << " disconnected" << std::endl;
-    });
+    // close the connection and clean buffers
+    auto channel = state_.channels.Remove(
+        channel_handle(client), [this](Channel &channel) {
+          // Results that arrived since the last relay, taken before the
+          // legs close. The client is not written after this.
+          relay_results(channel);
+          channel.closed = true;
+        });
+    if (channel) {
+      std::cout << "Client " << channel->id << " disconnected" << std::endl;
+      std::lock_guard<std::mutex> lock(channel->mutex);
+      for (auto &leg : channel->legs) {
+        if (leg.tap) {
+          tap_.Close(leg.tap);
+          leg.tap.reset();
+        }
+      }
+      for (auto &limiter : channel->limiters) {
+        limiter->Release();
+      }
+      channel->limiters.clear();
+      if (channel->capture_id) {
+        capture_.Close(channel->capture_id);
+      }
+    }
   }
   void on_data(WebsocketClient &client, std::string_view data, int type) {
-    auto id = client.Address() + ":" + client.Port();
-    safe_state_.MutableUse([&id, &data, &client, this](SharedState &state) {
-      // do the handshake with ASR or stream audio
-      try {
-        if (!state.channel_exists(id)) {
-          std::cout << "Channel not found" << std::endl;
+    auto channel = state_.channels.Find(channel_handle(client));
+    if (!channel) {
+      std::cout << "Channel not found" << std::endl;
+      client.Close();
+      return;
+    }
+    // Reads the clock for sampled calls only, the channel lookup is left out
+    TraceSpan span(channel->trace_id, TraceName::OnData);
+    // Only frames of the same call contend on this lock
+    auto lock_start = channel->trace_id ? trace_clock() : 0;
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    if (channel->trace_id) {
+      Tracer::Instance().Record(TraceName::LockWait, channel->trace_id,
+                                lock_start, trace_clock());
+    }
+    // do the handshake with ASR or stream audio
+    try {
+      if (channel->state == 0) {
+        if (state_.draining) {
+          // Let the PBX place the call on another router
+          RouterMetrics::Instance().Error(ErrorType::Draining);
+          client.Close();
+          return;
+        }
+        TraceSpan setup_span(channel->trace_id, TraceName::CallSetup);
+        // Parse init message and configure the channel, the raw message is
+        // forwarded to the ASR as is
+        auto raw_handshake = std::string(data.begin(), data.end());
+        VOHandshakeMessage handshake =
+            ParseJSON<VOHandshakeMessage>(raw_handshake);
+
+        auto selector =
+            handshake.meta.account_id + ":" + handshake.meta.configuration_id;
+        // Compatibility with 1.0
+        if (Exists(handshake.node_selector))
+          selector = Value(handshake.node_selector);
+        if (state_.limits.Admit(handshake.meta.account_id, selector,
+                                channel->limiters) != LimitReason::None) {
+          // Over the tenant limits, other tenants keep their latency
+          RouterMetrics::Instance().Error(ErrorType::RateLimited);
           client.Close();
+          return;
+        }
+        channel->capture_id = capture_.Open(handshake.call_id, raw_handshake);
+
+        channel->node_selector = selector;
+        channel->failover_deadline =
+            std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(settings_.balancer.failover_ms);
+        uint32_t channels =
+            Exists(handshake.channels) ? Value(handshake.channels) : 1;
+        SampleFormat format = SampleFormat::F32;
+        if (Exists(handshake.sample_format) &&
+            !parse_sample_format(Value(handshake.sample_format), format)) {
+          throw std::logic_error("unknown sample format");
+        }
+        uint32_t rate = Exists(handshake.sample_rate)
+                            ? Value(handshake.sample_rate)
+                            : Transcoder::kOutputRate;
+        bool downmix = Exists(handshake.downmix) && Value(handshake.downmix);
+        if (channels <= 1 && format == SampleFormat::F32 &&
+            rate == Transcoder::kOutputRate) {
+          // Forwarded as is unless the node takes a compressed format
+          channel->legs.resize(1);
+          connect_upstream(*channel, channel->legs[0],
+                           [&](WireFormat wire_format) {
+                             if (wire_format == WireFormat::F32) {
+                               return raw_handshake;
+                             }
+                             auto node_handshake = handshake;
+                             node_handshake.wire_format =
+                                 std::string(wire_format_name(wire_format));
+                             return std::string(JSON(node_handshake));
+                           });
+        } else {
+          if (channels > 1 && !downmix &&
+              handshake.speakers.size() != channels) {
+            throw std::logic_error("expected one speaker per channel");
+          }
+          channel->transcoder =
+              std::make_unique<Transcoder>(format, rate, channels, downmix);
+          // Every output becomes a mono 16 kHz float32 call with its own node
+          auto outputs = channel->transcoder->Outputs();
+          channel->legs.resize(outputs);
+          for (uint32_t c = 0; c < outputs; c++) {
+            VOHandshakeMessage leg_handshake = handshake;
+            if (outputs > 1) {
+              leg_handshake.speakers = {handshake.speakers[c]};
+            }
+            leg_handshake.channels = 1u;
+            leg_handshake.sample_format = std::string("f32");
+            leg_handshake.sample_rate = Transcoder::kOutputRate;
+            leg_handshake.downmix = false;
+            connect_upstream(*channel, channel->legs[c],
+                             [&](WireFormat wire_format) {
+                               leg_handshake.wire_format = std::string(
+                                   wire_format_name(wire_format));
+                               return std::string(JSON(leg_handshake));
+                             });
+          }
+        }
+        for (size_t c = 0; c < channel->legs.size(); c++) {
+          auto &leg = channel->legs[c];
+          leg.tap = tap_.Open(selector, handshake.call_id, c);
+          if (settings_.vad.enabled && leg.encoder->Framed()) {
+            leg.vad = std::make_unique<VoiceDetector>(
+                settings_.vad.threshold_db, settings_.vad.hangover_ms);
+          }
         }
-        if (state.channel_states[id] == 0) {
-          // Parse init message and configure the channel
-          auto to_parse = std::string(data.begin(), data.end());
-          VOHandshakeMessage handshake =
-              ParseJSON<VOHandshakeMessage>(to_parse);
-
-          auto selector =
-              handshake.meta.account_id + ":" + handshake.meta.configuration_id;
-          // Compatibility with 1.0
-          if (Exists(handshake.node_selector))
-            selector = Value(handshake.node_selector);
-
-          auto node = state.next_node(id, selector);
-          const timeval tcp_read_to = {ws_config_.timeout_read_sec, 0};
-          const timeval tcp_write_to = {ws_config_.timeout_write_sec, 0};
-          state.channels[id] = Channel{
-              std::make_unique<current::net::Connection>(
-                  current::net::Connection(current::net::ClientSocket(
-                      node.host, node.port, tcp_read_to, tcp_write_to))),
-              selector, 0};
-          // Do the handshake: send init message and read sync byte
-          state.channels[id].conn->BlockingWrite(data.data(), data.size(),
-                                                 true);
-          uint8_t read_to = 0;
-          state.channels[id].conn->BlockingRead(&read_to, 1);
-          // Update channel state - ready to stream
-          state.channel_states[id] = 1;
+        // Update channel state - ready to stream
+        state_.channels.MarkStreaming(*channel);
+      } else if (channel->state == 1) {
+        if (channel->capture_id) {
+          capture_.Frame(channel->capture_id, data);
+        }
+        TraceSpan forward_span(channel->trace_id, TraceName::Forward);
+        bool ok = channel->transcoder
+                      ? forward_transcoded(*channel, data)
+                      : forward(*channel, channel->legs[0], data);
+        if (!ok) {
+          // PBX is responsible for reconnects, it still gets the results
+          // the node sent before it went away
+          relay_results(*channel);
+          client.Close();
         } else {
-          state.channels[id].conn->BlockingWrite(data.data(), data.size(),
-                                                 true);
-        }
-      } catch (const current::Exception &e) {
-        std::cout << "error"
-                  << ": " << e.OriginalDescription() << " "
-                  << e.DetailedDescription() << std::endl;
-        // PBX is responsible for reconnects, in case of error we have to drop
-        // the connection and let PBX decide/reconnect if needed
-        client.Close();
-      } catch (const std::logic_error &e) {
-        std::cout << "error: empty handshake parse exception" << std::endl;
-        client.Close();
-      }
-      // Finish current buffer transmission and shutdown the connection
-      if (state.die) {
-        client.Close();
+          auto &metrics = RouterMetrics::Instance();
+          metrics.frames.Add(1);
+          metrics.bytes.Add(data.size());
+          channel->frames.fetch_add(1, std::memory_order_relaxed);
+          channel->bytes.fetch_add(data.size(), std::memory_order_relaxed);
+          if (!channel->limiters.empty()) {
+            charge_limits(*channel, data.size());
+          }
+          relay_results(*channel);
+        }
       }
-    });
+    } catch (const current::Exception &e) {
+      std::cout << "error"
+                << ": " << e.OriginalDescription() << " "
+                << e.DetailedDescription() << std::endl;
+      RouterMetrics::Instance().Error(ErrorType::HandshakeParse);
+      // PBX is responsible for reconnects, in case of error we have to drop
+      // the connection and let PBX decide/reconnect if needed
+      client.Close();
+    } catch (const NoNodesError &e) {
+      std::cout << "error: " << e.what() << std::endl;
+      RouterMetrics::Instance().Error(ErrorType::NoNodes);
+      client.Close();
+    } catch (const std::logic_error &e) {
+      std::cout << "error: handshake exception " << e.what() << std::endl;
+      RouterMetrics::Instance().Error(ErrorType::HandshakeParse);
+      client.Close();
+    }
+    // Finish current buffer transmission and shutdown the connection
+    if (state_.die) {
+      client.Close();
+    }
   }
 
 public:
   explicit StreamRouter(std::map<std::string, std::vector<VONode>> config,
-                        WSConfig ws_config)
-      : safe_state_(current::WaitableAtomic<SharedState>(
-            SharedState::FromMapping(config))),
-        ws_config_(ws_config),
+                        WSConfig ws_config,
+                        RouterSettings settings = RouterSettings())
+      : state_(std::move(config), balancer_policy(settings.balancer.policy)),
+        ws_config_(ws_config), settings_(std::move(settings)),
+        tap_(settings_.tap), capture_(capture_options(settings_.capture)),
+        upstream_(upstream_options(ws_config_, settings_),
+                  pool_options(ws_config_, settings_.upstream)),
+        prober_(state_.routing.Registry(), settings_.balancer.probe_interval_ms,
+                ws_config_.timeout_write_sec * 1000, probe_handshake()),
         server_(WebsocketServer(
             [this](WebsocketClient &client, std::string_view data, int type) {
               try {
@@ -142,7 +586,12 @@ public:
               }
             },
             ws_config_.port, ws_config_.host, ws_config_.n_threads,
-            ws_config_.timeout_ms)) {
+            ws_config_.timeout_ms)),
+        relay_([this](Channel &channel) { relay_results(channel); }) {
+    Tracer::Instance().SetSample(settings_.trace.sample);
+    state_.limits.Update(settings_.limits);
+    upstream_.SetNodes(state_.routing.Nodes());
+    check_vad();
     server_.start();
     std::cout << "Started stream router on " << ws_config_.host << ":"
               << ws_config_.port << std::endl;
@@ -166,39 +615,283 @@ public:
   void RedisProc(std::string host, int port, std::string user,
                  std::string pass) {
     auto sync_ = RedisSync(host, port, user, pass);
+    RedisWatcher watcher(host, port, user, pass, sync_.Key(),
+                         [this]() { WakeRedisSync(); });
     std::cout << "Started redis sync" << std::endl;
     while (true) {
+      {
+        // Config events resync right away, polling covers a subscription
+        // that is down and events lost on reconnect
+        std::unique_lock<std::mutex> lock(redis_mutex_);
+        redis_wake_.wait_for(
+            lock,
+            std::chrono::milliseconds(watcher.Connected() ? redis_fallback_ms_
+                                                          : redis_delay_ms_),
+            [this]() { return redis_pending_ || state_.die; });
+        redis_pending_ = false;
+      }
       // check for gracefull stop
-      if (safe_state_.ImmutableScopedAccessor()->die) {
+      if (state_.die) {
         std::cout << "Stop redis sync" << std::endl;
         break;
       }
 
       try {
-        // sync with redis
+        // sync with redis, unchanged content is skipped before parsing
         auto result = sync_.sync();
         if (result.first) {
-          // update config after successfull sync
-          safe_state_.MutableUse([&result](SharedState &state) {
-            for (auto &[key, value] : result.second) {
-              state.mapping[key] = value;
-            }
-          });
+          state_.limits.Update(sync_.Limits());
         }
+        if (result.first && state_.routing.Update(result.second)) {
+          upstream_.SetNodes(state_.routing.Nodes());
+          std::cout << "Routing updated to version "
+                    << state_.routing.Version() << std::endl;
+          check_vad();
+        }
+        // Calls connect to cached node addresses, they follow DNS here
+        state_.routing.Registry().Resolve();
       } catch (...) {
         std::cout << "Redis sync error" << std::endl;
       }
-
-      // wait for next round
-      std::this_thread::sleep_for(std::chrono::milliseconds(redis_delay_ms_));
     }
   }
 
+  void WakeRedisSync() {
+    {
+      std::lock_guard<std::mutex> lock(redis_mutex_);
+      redis_pending_ = true;
+    }
+    redis_wake_.notify_one();
+  }
   void BreakConnections() {
-    safe_state_.MutableUse([](SharedState &state) { state.die = true; });
+    state_.die = true;
+    WakeRedisSync();
+  }
+
+  // Stops taking calls, live ones may run until the deadline
+  void Drain(int timeout_sec) {
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    drain_deadline_ = std::chrono::steady_clock::now() +
+                      std::chrono::seconds(std::max(timeout_sec, 0));
+    if (!state_.draining.exchange(true)) {
+      std::cout << "Draining " << StreamsCount() << " streams" << std::endl;
+    }
+  }
+  bool Draining() const { return state_.draining; }
+  // True once a draining router has no calls left or ran out of time
+  bool Drained() {
+    if (!state_.draining) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    return StreamsCount() == 0 ||
+           std::chrono::steady_clock::now() >= drain_deadline_;
+  }
+  uint32_t StreamsCount() const { return state_.channels.LiveStreams(); }
+
+  // Copies the counters of this worker to the segment the master reads
+  void PublishShared(SharedCounters &counters, size_t index) {
+    auto &slot = counters.worker[index];
+    auto &metrics = RouterMetrics::Instance();
+    slot.live_streams = StreamsCount();
+    slot.draining = Draining();
+    slot.frames = metrics.frames.Value();
+    slot.bytes = metrics.bytes.Value();
+    for (size_t i = 0; i < metrics.errors.size(); i++) {
+      slot.errors[i] = metrics.errors[i].Value();
+    }
+    // Node traffic goes in as deltas since every worker adds to it
+    for (auto &[key, stats] : state_.routing.Registry().All()) {
+      if (!stats->shared) {
+        continue;
+      }
+      auto frames = stats->frames.Value();
+      auto bytes = stats->bytes.Value();
+      stats->shared->frames += frames - stats->published_frames;
+      stats->shared->bytes += bytes - stats->published_bytes;
+      stats->published_frames = frames;
+      stats->published_bytes = bytes;
+    }
   }
-  uint32_t StreamsCount() const {
-    return safe_state_.ImmutableScopedAccessor()->channels.size();
+
+  // Prometheus text exposition of the router and per channel/node counters
+  std::string PrometheusMetrics() {
+    auto &metrics = RouterMetrics::Instance();
+    PrometheusWriter out;
+    out.Family("vocallout_routing_version", "gauge",
+               "Routing table updates applied");
+    out.Sample("vocallout_routing_version", {}, state_.routing.Version());
+    out.Family("vocallout_draining", "gauge",
+               "1 while the router refuses new calls");
+    out.Sample("vocallout_draining", {}, Draining() ? 1 : 0);
+    out.Family("vocallout_live_streams", "gauge", "Streams forwarded now");
+    out.Sample("vocallout_live_streams", {}, StreamsCount());
+    out.Family("vocallout_selector_streams", "gauge",
+               "Streams forwarded now per selector");
+    for (auto &[selector, count] : state_.channels.SelectorStreams()) {
+      out.Sample("vocallout_selector_streams", {{"selector", selector}},
+                 count);
+    }
+    out.Family("vocallout_frames_total", "counter", "Audio frames forwarded");
+    out.Sample("vocallout_frames_total", {}, metrics.frames.Value());
+    out.Family("vocallout_bytes_total", "counter", "Audio bytes forwarded");
+    out.Sample("vocallout_bytes_total", {}, metrics.bytes.Value());
+    out.Family("vocallout_pool_stale_total", "counter",
+               "Pooled sockets found closed at handshake and redialed");
+    out.Sample("vocallout_pool_stale_total", {}, metrics.pool_stale.Value());
+    out.Family("vocallout_vad_skipped_bytes_total", "counter",
+               "Audio bytes replaced by silence markers");
+    out.Sample("vocallout_vad_skipped_bytes_total", {},
+               metrics.vad_skipped_bytes.Value());
+    out.Family("vocallout_errors_total", "counter", "Errors by type");
+    for (size_t i = 0; i < metrics.errors.size(); i++) {
+      out.Sample("vocallout_errors_total",
+                 {{"type", error_type_name(static_cast<ErrorType>(i))}},
+                 metrics.errors[i].Value());
+    }
+    if (tap_.Enabled()) {
+      out.Family("vocallout_tap_frames_total", "counter",
+                 "Frames copied to the audio tap");
+      out.Sample("vocallout_tap_frames_total", {}, tap_.frames.Value());
+      out.Family("vocallout_tap_dropped_frames_total", "counter",
+                 "Tapped frames dropped on a full queue or disk errors");
+      out.Sample("vocallout_tap_dropped_frames_total", {},
+                 tap_.dropped_frames.Value());
+      out.Family("vocallout_tap_written_bytes_total", "counter",
+                 "Audio bytes written by the tap");
+      out.Sample("vocallout_tap_written_bytes_total", {},
+                 tap_.bytes_written.Value());
+      out.Family("vocallout_tap_files_total", "counter",
+                 "Recording segments opened by the tap");
+      out.Sample("vocallout_tap_files_total", {}, tap_.files.Value());
+    }
+    if (capture_.Enabled()) {
+      out.Family("vocallout_capture_records_total", "counter",
+                 "Records queued for the capture file");
+      out.Sample("vocallout_capture_records_total", {},
+                 capture_.records.Value());
+      out.Family("vocallout_capture_dropped_records_total", "counter",
+                 "Records dropped on a full capture queue");
+      out.Sample("vocallout_capture_dropped_records_total", {},
+                 capture_.dropped_records.Value());
+      out.Family("vocallout_capture_dropped_audio_total", "counter",
+                 "Frames captured without audio, larger than a frame block");
+      out.Sample("vocallout_capture_dropped_audio_total", {},
+                 capture_.dropped_audio.Value());
+    }
+    out.Family("vocallout_limit_streams", "gauge",
+               "Streams counted against a tenant limit");
+    state_.limits.ForEach([&out](const std::string &key, TenantLimiter &l) {
+      out.Sample("vocallout_limit_streams", {{"key", key}}, l.Streams());
+    });
+    out.Family("vocallout_limit_rejected_total", "counter",
+               "Calls refused by a tenant limit");
+    state_.limits.ForEach([&out](const std::string &key, TenantLimiter &l) {
+      for (size_t i = 1; i < l.rejected.size(); i++) {
+        out.Sample("vocallout_limit_rejected_total",
+                   {{"key", key},
+                    {"reason", limit_reason_name(static_cast<LimitReason>(i))}},
+                   l.rejected[i].load());
+      }
+    });
+    out.Family("vocallout_results_total", "counter",
+               "Node result lines relayed to the PBX");
+    out.Sample("vocallout_results_total", {}, metrics.results.Value());
+    out.Family("vocallout_results_dropped_total", "counter",
+               "Result lines dropped on a full queue");
+    out.Sample("vocallout_results_dropped_total", {},
+               metrics.results_dropped.Value());
+    out.Histogram("vocallout_result_seconds",
+                  "Last audio sent to the node until its result arrived",
+                  metrics.result_latency);
+    out.Histogram("vocallout_result_relay_seconds",
+                  "Result wait in the router before going to the PBX",
+                  metrics.result_relay_latency);
+    out.Histogram("vocallout_handshake_seconds",
+                  "Upstream connect and handshake latency",
+                  metrics.handshake_latency);
+    out.Histogram("vocallout_upstream_write_seconds",
+                  "Upstream sendmsg latency", metrics.write_latency);
+
+    auto nodes = state_.routing.Registry().All();
+    auto node_family = [&out, &nodes](const std::string &name,
+                                      const std::string &type,
+                                      const std::string &help, auto value) {
+      out.Family(name, type, help);
+      for (auto &[key, stats] : nodes) {
+        out.Sample(name,
+                   {{"node", key.first + ":" + std::to_string(key.second)}},
+                   value(*stats));
+      }
+    };
+    node_family("vocallout_node_streams", "gauge", "Streams per node",
+                [](NodeStats &n) { return n.active_streams.load(); });
+    node_family("vocallout_node_frames_total", "counter",
+                "Audio frames forwarded per node",
+                [](NodeStats &n) { return n.frames.Value(); });
+    node_family("vocallout_node_bytes_total", "counter",
+                "Audio bytes forwarded per node",
+                [](NodeStats &n) { return n.bytes.Value(); });
+    node_family("vocallout_node_handshake_seconds", "gauge",
+                "Moving average of the node handshake latency",
+                [](NodeStats &n) { return n.handshake_us.load() / 1e6; });
+    node_family("vocallout_node_ejected", "gauge",
+                "1 while the node circuit breaker is open",
+                [](NodeStats &n) { return n.Ejected() ? 1 : 0; });
+
+    struct ChannelSample {
+      std::string id;
+      uint64_t frames, bytes;
+      bool has_queue;
+      size_t queued, high_water;
+      uint64_t dropped;
+    };
+    std::vector<ChannelSample> channels;
+    state_.channels.ForEach([&channels](Channel &channel) {
+      ChannelSample sample{channel.id, channel.frames.load(),
+                           channel.bytes.load(), false, 0, 0, 0};
+      // Never wait on a busy channel, its queue stats are skipped instead
+      std::unique_lock<std::mutex> lock(channel.mutex, std::try_to_lock);
+      if (lock.owns_lock()) {
+        for (auto &leg : channel.legs) {
+          if (leg.conn) {
+            sample.has_queue = true;
+            sample.queued += leg.conn->QueuedBytes();
+            sample.high_water =
+                std::max(sample.high_water, leg.conn->HighWaterBytes());
+            sample.dropped += leg.conn->DroppedBytes();
+          }
+        }
+      }
+      channels.push_back(std::move(sample));
+    });
+    auto channel_family = [&out, &channels](const std::string &name,
+                                            const std::string &type,
+                                            const std::string &help,
+                                            auto value, bool queue) {
+      out.Family(name, type, help);
+      for (auto &c : channels) {
+        if (!queue || c.has_queue) {
+          out.Sample(name, {{"channel", c.id}}, value(c));
+        }
+      }
+    };
+    channel_family("vocallout_channel_frames_total", "counter",
+                   "Audio frames forwarded per channel",
+                   [](ChannelSample &c) { return c.frames; }, false);
+    channel_family("vocallout_channel_bytes_total", "counter",
+                   "Audio bytes forwarded per channel",
+                   [](ChannelSample &c) { return c.bytes; }, false);
+    channel_family("vocallout_channel_queue_bytes", "gauge",
+                   "Audio waiting for the upstream per channel",
+                   [](ChannelSample &c) { return c.queued; }, true);
+    channel_family("vocallout_channel_queue_high_water_bytes", "gauge",
+                   "Largest upstream backlog per channel",
+                   [](ChannelSample &c) { return c.high_water; }, true);
+    channel_family("vocallout_channel_dropped_bytes_total", "counter",
+                   "Audio dropped by the overflow policy per channel",
+                   [](ChannelSample &c) { return c.dropped; }, true);
+    return out.str();
   }
   StreamRouter(const StreamRouter &) = delete;
   ~StreamRouter() = default;
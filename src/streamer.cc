@@ -5,17 +5,21 @@ PLS_INCLUDE_HEADER_ONLY_CURRENT();
 #include "blocks/xterm/progress.h"
 #include "blocks/xterm/vt100.h"
 #include "bricks/dflags/dflags.h"
-#include "bricks/net/tcp/tcp.h"
 #include "bricks/strings/printf.h"
 #include "bricks/time/chrono.h"
+#include "dsp.h"
+#include "loadgen.h"
 #include "third_party/wav.h"
+#include "ws_client.h"
 
 DEFINE_string(host, "127.0.0.1", "The destination address to send data to.");
-DEFINE_uint16(port, 9001, "The port to use.");
+DEFINE_uint16(port, 8080, "The router websocket port.");
 DEFINE_uint16(sampling_rate, COMMON_SAMPLE_RATE, "Sampling rate");
 DEFINE_string(filename, "samples/jfk.wav", "Input audio file");
+DEFINE_string(call_id, "streamer", "Call id sent in the handshake");
+DEFINE_string(account_id, "streamer", "Account id sent in the handshake");
+DEFINE_string(node_selector, "", "Node selector sent in the handshake");
 
-using namespace current::net;
 using namespace current::vt100;
 
 int main(int argc, char **argv) {
@@ -48,7 +52,22 @@ int main(int argc, char **argv) {
               << " sec" << std::endl;
   }
 
-  // TODO support multi channel audio
+  // Multi channel audio is sent interleaved, the router splits the speakers
+  uint32_t channels = 1;
+  std::vector<float> audio = mono_in;
+  if (is_multichan && stereo_in.size() > 1) {
+    channels = std::min<uint32_t>(stereo_in.size(), kMaxAudioChannels);
+    size_t frames = stereo_in[0].size();
+    std::vector<const char *> speakers;
+    for (uint32_t c = 0; c < channels; c++) {
+      frames = std::min(frames, stereo_in[c].size());
+      speakers.push_back(reinterpret_cast<const char *>(stereo_in[c].data()));
+    }
+    audio.resize(frames * channels);
+    interleave(speakers.data(), frames, channels, sizeof(float),
+               reinterpret_cast<char *>(audio.data()));
+  }
+  const size_t chunk_samples = size_t(FLAGS_sampling_rate) * channels;
 
   current::ProgressLine progress;
   progress << "Starting the audio streamer";
@@ -58,22 +77,23 @@ int main(int argc, char **argv) {
 
   while (true) {
     try {
-      Connection connection(ClientSocket(FLAGS_host, FLAGS_port));
+      WebsocketConnection connection(FLAGS_host, FLAGS_port);
+      connection.SendText(load_handshake(FLAGS_call_id, FLAGS_account_id,
+                                         FLAGS_node_selector, channels));
       while (true) {
         // Get next chunk of audio
         std::vector<float> chunk = std::vector<float>(
-            mono_in.begin() + pos,
-            mono_in.begin() +
-                std::min(pos + FLAGS_sampling_rate, mono_in.size()));
+            audio.begin() + std::min(pos, audio.size()),
+            audio.begin() + std::min(pos + chunk_samples, audio.size()));
         int len = sizeof(float) * chunk.size();
-        pos += FLAGS_sampling_rate;
+        pos += chunk_samples;
         // Stop if all recording was transmitted
         if (!chunk.size()) {
           is_done = true;
           break;
         }
         // Send current chunk
-        connection.BlockingWrite(chunk.data(), len, true);
+        connection.Send(chunk.data(), len);
         total_sent += len;
         progress << reset << "Sent " << total_sent;
 
@@ -81,9 +101,10 @@ int main(int argc, char **argv) {
         // sending next buffer)
         std::this_thread::sleep_for(std::chrono::seconds(1));
       }
-    } catch (const current::Exception &e) {
+      connection.Close();
+    } catch (const std::runtime_error &e) {
       progress << red << bold << "error"
-               << ": " << e.DetailedDescription() << reset;
+               << ": " << e.what() << reset;
     }
     if (is_done) {
       break;
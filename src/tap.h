@@ -0,0 +1,388 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "buffers.h"
+#include "metrics.h"
+
+// Audio tap for QA and ASR training: a sample of the forwarded 16 kHz
+// float32 legs is copied into pooled blocks, handed to a writer thread over a
+// lock free queue and written as WAV segments. Forwarding never waits on the
+// disk, a full queue drops the block and counts its frames.
+
+template <typename T> class BoundedQueue final {
+  // Bounded MPMC ring with per cell sequence numbers (Vyukov), producers and
+  // the consumer never take a lock
+  struct alignas(64) Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+  std::vector<Cell> cells_;
+  const size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+
+  static size_t round_up(size_t n) {
+    size_t size = 2;
+    while (size < n) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+public:
+  explicit BoundedQueue(size_t capacity)
+      : cells_(round_up(capacity)), mask_(cells_.size() - 1) {
+    for (size_t i = 0; i < cells_.size(); i++) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // False if the queue is full, value is left untouched
+  bool Push(T &value) {
+    auto pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = cells_[pos & mask_];
+      auto seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = intptr_t(seq) - intptr_t(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  bool Pop(T &value) {
+    auto pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = cells_[pos & mask_];
+      auto seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = intptr_t(seq) - intptr_t(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+struct TapOptions {
+  // Empty disables the tap
+  std::string dir;
+  // Selectors to sample, empty samples all of them
+  std::set<std::string> selectors;
+  // Fraction of calls recorded, picked by call id so all legs go together
+  double sample = 1.0;
+  uint32_t segment_sec = 300;
+  size_t queue_blocks = 4096;
+};
+
+// One tapped leg. The producer side is only touched under the channel lock,
+// the file side only by the writer thread.
+struct TapStream final {
+  std::string name;
+  // Producer: frames are packed into the block until it is full
+  FrameRef block;
+  uint32_t block_frames = 0;
+  // Writer
+  int fd = -1;
+  uint32_t segment = 0;
+  uint64_t segment_bytes = 0;
+};
+
+class AudioTap final {
+  struct Entry {
+    std::shared_ptr<TapStream> stream;
+    FrameRef block;
+    uint32_t frames = 0;
+  };
+  static constexpr uint32_t kRate = 16000;
+  static constexpr size_t kBatch = 256;
+
+  const TapOptions options_;
+  BoundedQueue<Entry> queue_;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+  // Closed streams are found through this list, guarded by closed_mutex_
+  std::mutex closed_mutex_;
+  std::vector<std::shared_ptr<TapStream>> closed_;
+
+  static std::string sanitize(const std::string &value) {
+    std::string out;
+    for (auto c : value.substr(0, 96)) {
+      out += std::isalnum(static_cast<unsigned char>(c)) || c == '-' ||
+                     c == '.'
+                 ? c
+                 : '_';
+    }
+    return out;
+  }
+
+  // 44 byte WAVE_FORMAT_IEEE_FLOAT mono header for data_bytes of samples
+  static std::string wav_header(uint32_t data_bytes) {
+    auto u32 = [](std::string &out, uint32_t v) {
+      out.append(reinterpret_cast<const char *>(&v), 4);
+    };
+    auto u16 = [](std::string &out, uint16_t v) {
+      out.append(reinterpret_cast<const char *>(&v), 2);
+    };
+    std::string header = "RIFF";
+    u32(header, 36 + data_bytes);
+    header += "WAVEfmt ";
+    u32(header, 16);
+    u16(header, 3); // IEEE float
+    u16(header, 1);
+    u32(header, kRate);
+    u32(header, kRate * sizeof(float));
+    u16(header, sizeof(float));
+    u16(header, 32);
+    header += "data";
+    u32(header, data_bytes);
+    return header;
+  }
+
+  bool OpenSegment(TapStream &stream) {
+    auto path = options_.dir + "/" + stream.name + "_" +
+                std::to_string(stream.segment) + ".wav";
+    stream.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0644);
+    if (stream.fd < 0) {
+      std::cout << "Tap: can't open " << path << ": " << strerror(errno)
+                << std::endl;
+      return false;
+    }
+    auto header = wav_header(0);
+    if (write(stream.fd, header.data(), header.size()) !=
+        ssize_t(header.size())) {
+      CloseSegment(stream);
+      return false;
+    }
+    stream.segment_bytes = 0;
+    files.Add(1);
+    return true;
+  }
+  // Patches the sizes into the header, the page cache is dropped since
+  // segments are not read back by the router
+  void CloseSegment(TapStream &stream) {
+    if (stream.fd < 0) {
+      return;
+    }
+    auto header = wav_header(uint32_t(stream.segment_bytes));
+    (void)!pwrite(stream.fd, header.data(), header.size(), 0);
+    posix_fadvise(stream.fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(stream.fd);
+    stream.fd = -1;
+    stream.segment++;
+  }
+
+  // Writes the blocks of one stream with as few syscalls as possible, a
+  // segment boundary ends the current write
+  void Write(TapStream &stream, std::vector<Entry *> &entries) {
+    const uint64_t segment_limit =
+        uint64_t(std::max(options_.segment_sec, 1u)) * kRate * sizeof(float);
+    std::vector<iovec> iov;
+    iov.reserve(std::min<size_t>(entries.size(), IOV_MAX));
+    size_t i = 0;
+    while (i < entries.size()) {
+      if (stream.fd >= 0 && stream.segment_bytes >= segment_limit) {
+        CloseSegment(stream);
+      }
+      if (stream.fd < 0 && !OpenSegment(stream)) {
+        for (; i < entries.size(); i++) {
+          dropped_frames.Add(entries[i]->frames);
+        }
+        return;
+      }
+      iov.clear();
+      size_t bytes = 0;
+      uint64_t batch_frames = 0;
+      for (; i < entries.size() && iov.size() < IOV_MAX &&
+             stream.segment_bytes + bytes < segment_limit;
+           i++) {
+        auto &block = *entries[i]->block;
+        iov.push_back(iovec{block.data, block.size});
+        bytes += block.size;
+        batch_frames += entries[i]->frames;
+      }
+      auto n = writev(stream.fd, iov.data(), int(iov.size()));
+      if (n < 0) {
+        std::cout << "Tap: write failed for " << stream.name << ": "
+                  << strerror(errno) << std::endl;
+        dropped_frames.Add(batch_frames);
+        CloseSegment(stream);
+        continue;
+      }
+      stream.segment_bytes += n;
+      bytes_written.Add(n);
+    }
+  }
+
+  void Run() {
+    std::unordered_map<TapStream *, std::shared_ptr<TapStream>> open;
+    std::vector<Entry> batch;
+    batch.reserve(kBatch);
+    std::unordered_map<TapStream *, std::vector<Entry *>> grouped;
+    while (true) {
+      // Streams closed before the drain have all their blocks queued
+      std::vector<std::shared_ptr<TapStream>> closed;
+      {
+        std::lock_guard<std::mutex> lock(closed_mutex_);
+        closed.swap(closed_);
+      }
+      bool stopping = stop_;
+      bool idle = true;
+      while (true) {
+        batch.clear();
+        Entry entry;
+        while (batch.size() < kBatch && queue_.Pop(entry)) {
+          batch.push_back(std::move(entry));
+        }
+        if (batch.empty()) {
+          break;
+        }
+        idle = false;
+        grouped.clear();
+        for (auto &e : batch) {
+          open.emplace(e.stream.get(), e.stream);
+          grouped[e.stream.get()].push_back(&e);
+        }
+        for (auto &[stream, entries] : grouped) {
+          Write(*stream, entries);
+        }
+      }
+      for (auto &stream : closed) {
+        CloseSegment(*stream);
+        open.erase(stream.get());
+      }
+      if (stopping) {
+        break;
+      }
+      if (idle && closed.empty()) {
+        // Blocks fill in a quarter second per leg, no need to spin
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      }
+    }
+    for (auto &[ptr, stream] : open) {
+      CloseSegment(*stream);
+    }
+  }
+
+public:
+  ShardedCounter frames;
+  ShardedCounter dropped_frames;
+  ShardedCounter bytes_written;
+  ShardedCounter files;
+
+  explicit AudioTap(TapOptions options)
+      : options_(std::move(options)),
+        queue_(Enabled() ? options_.queue_blocks : 2) {
+    if (!Enabled()) {
+      return;
+    }
+    mkdir(options_.dir.c_str(), 0755);
+    thread_ = std::thread([this]() { Run(); });
+    std::cout << "Tapping " << options_.sample * 100 << "% of calls to "
+              << options_.dir << std::endl;
+  }
+  AudioTap(const AudioTap &) = delete;
+  ~AudioTap() {
+    if (thread_.joinable()) {
+      stop_ = true;
+      thread_.join();
+    }
+  }
+
+  bool Enabled() const { return !options_.dir.empty(); }
+
+  // Decides on call setup if the call is recorded, one stream per leg
+  std::shared_ptr<TapStream> Open(const std::string &selector,
+                                  const std::string &call_id, size_t leg) {
+    if (!Enabled() || options_.sample <= 0 ||
+        (!options_.selectors.empty() && !options_.selectors.count(selector))) {
+      return nullptr;
+    }
+    auto hash = std::hash<std::string>{}(call_id) % 10000;
+    if (hash >= options_.sample * 10000) {
+      return nullptr;
+    }
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+                   .count();
+    auto stream = std::make_shared<TapStream>();
+    stream->name = std::to_string(now) + "_" + sanitize(selector) + "_" +
+                   sanitize(call_id) + "_s" + std::to_string(leg);
+    return stream;
+  }
+
+  // Copies one frame of 16 kHz float32 audio, never blocks
+  void Write(const std::shared_ptr<TapStream> &stream, std::string_view data) {
+    frames.Add(1);
+    while (!data.empty()) {
+      if (!stream->block || stream->block->Free() == 0 ||
+          (data.size() <= FrameBlock::kSize &&
+           stream->block->Free() < data.size())) {
+        Push(stream);
+        stream->block = FrameRef::Allocate();
+      }
+      auto &block = *stream->block;
+      auto n = std::min(data.size(), block.Free());
+      std::memcpy(block.data + block.size, data.data(), n);
+      block.size += n;
+      data.remove_prefix(n);
+    }
+    stream->block_frames++;
+  }
+  // Queues the last block, the writer finalizes the file after it
+  void Close(const std::shared_ptr<TapStream> &stream) {
+    Push(stream);
+    std::lock_guard<std::mutex> lock(closed_mutex_);
+    closed_.push_back(stream);
+  }
+
+private:
+  void Push(const std::shared_ptr<TapStream> &stream) {
+    if (!stream->block) {
+      return;
+    }
+    Entry entry{stream, std::move(stream->block), stream->block_frames};
+    stream->block_frames = 0;
+    if (!queue_.Push(entry)) {
+      dropped_frames.Add(entry.frames);
+    }
+  }
+};
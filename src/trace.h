@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Per call spans of the hot path. Every thread records into its own ring of
+// fixed slots, the /trace dump reads the rings without stopping writers and
+// skips slots caught mid write. Calls that are not sampled pay one branch.
+
+inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+enum class TraceName : uint32_t {
+  OnData = 0,
+  LockWait,
+  CallSetup,
+  Forward,
+  Connect,
+  SyncWait,
+  Write,
+  Count
+};
+
+inline const char *trace_name(TraceName name) {
+  static const char *names[] = {"on_data",  "lock_wait",        "call_setup",
+                                "forward",  "upstream_connect", "sync_wait",
+                                "sendmsg"};
+  return names[static_cast<size_t>(name)];
+}
+
+class TraceRing final {
+  // Single writer. A slot's seq is odd while it is written and 2 * (n + 1)
+  // once event n is complete, readers drop slots whose seq moved.
+  static constexpr size_t kSize = 4096;
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> start{0};
+    std::atomic<uint64_t> end{0};
+    std::atomic<uint64_t> call{0};
+    std::atomic<uint32_t> name{0};
+  };
+  std::vector<Slot> slots_ = std::vector<Slot>(kSize);
+  std::atomic<uint64_t> head_{0};
+
+public:
+  struct Event {
+    uint64_t start, end, call;
+    TraceName name;
+  };
+
+  void Record(TraceName name, uint64_t call, uint64_t start, uint64_t end) {
+    auto n = head_.load(std::memory_order_relaxed);
+    auto &slot = slots_[n % kSize];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.start.store(start, std::memory_order_relaxed);
+    slot.end.store(end, std::memory_order_relaxed);
+    slot.call.store(call, std::memory_order_relaxed);
+    slot.name.store(static_cast<uint32_t>(name), std::memory_order_relaxed);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+    head_.store(n + 1, std::memory_order_release);
+  }
+
+  void Read(uint64_t call, std::vector<Event> &out) const {
+    for (auto &slot : slots_) {
+      auto seq = slot.seq.load(std::memory_order_acquire);
+      if (seq == 0 || seq % 2) {
+        continue;
+      }
+      Event event{slot.start.load(std::memory_order_relaxed),
+                  slot.end.load(std::memory_order_relaxed),
+                  slot.call.load(std::memory_order_relaxed),
+                  static_cast<TraceName>(
+                      slot.name.load(std::memory_order_relaxed))};
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq ||
+          (call && event.call != call)) {
+        continue;
+      }
+      out.push_back(event);
+    }
+  }
+};
+
+class Tracer final {
+  std::atomic<uint32_t> sample_{0}; // calls per 10000
+  // Pairs a tick count with steady clock time to convert ticks later
+  const uint64_t base_ticks_ = trace_clock();
+  const std::chrono::steady_clock::time_point base_time_ =
+      std::chrono::steady_clock::now();
+
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<TraceRing>> rings_;
+
+  TraceRing &Local() {
+    // Rings outlive their threads so recent spans stay readable
+    thread_local std::shared_ptr<TraceRing> ring = [this]() {
+      auto ring = std::make_shared<TraceRing>();
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings_.push_back(ring);
+      return ring;
+    }();
+    return *ring;
+  }
+
+public:
+  static Tracer &Instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  // Fraction of calls traced, 0 disables tracing
+  void SetSample(double sample) {
+    sample_ = uint32_t(std::clamp(sample, 0.0, 1.0) * 10000);
+  }
+  // Trace id of a new call, 0 if the call is not sampled
+  uint64_t Sample(const std::string &call) const {
+    auto sample = sample_.load(std::memory_order_relaxed);
+    if (sample == 0) {
+      return 0;
+    }
+    auto id = TraceId(call);
+    return id % 10000 < sample ? id : 0;
+  }
+  static uint64_t TraceId(const std::string &call) {
+    return std::hash<std::string>{}(call) | 1;
+  }
+
+  void Record(TraceName name, uint64_t call, uint64_t start, uint64_t end) {
+    Local().Record(name, call, start, end);
+  }
+
+  // Chrome trace event JSON (chrome://tracing, ui.perfetto.dev), one track
+  // per recording thread. call filters on a trace id, 0 dumps everything.
+  std::string ChromeJSON(uint64_t call = 0) {
+    std::vector<std::shared_ptr<TraceRing>> rings;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings = rings_;
+    }
+    auto now_ticks = trace_clock();
+    auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - base_time_)
+                          .count();
+    double ns_per_tick =
+        now_ticks > base_ticks_ && elapsed_ns > 0
+            ? double(elapsed_ns) / double(now_ticks - base_ticks_)
+            : 1.0;
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    std::vector<TraceRing::Event> events;
+    for (size_t tid = 0; tid < rings.size(); tid++) {
+      events.clear();
+      rings[tid]->Read(call, events);
+      std::sort(events.begin(), events.end(),
+                [](auto &a, auto &b) { return a.start < b.start; });
+      for (auto &e : events) {
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+                 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"call\":\"%016llx\"}}",
+                 first ? "" : ",", trace_name(e.name), tid,
+                 double(e.start - base_ticks_) * ns_per_tick / 1e3,
+                 double(e.end - e.start) * ns_per_tick / 1e3,
+                 static_cast<unsigned long long>(e.call));
+        out << line;
+        first = false;
+      }
+    }
+    out << "]}";
+    return out.str();
+  }
+};
+
+class TraceSpan final {
+  // Records [start, destruction) for traced calls, no-op for call 0
+  const uint64_t call_;
+  const TraceName name_;
+  const uint64_t start_;
+
+public:
+  TraceSpan(uint64_t call, TraceName name)
+      : call_(call), name_(name), start_(call ? trace_clock() : 0) {}
+  TraceSpan(uint64_t call, TraceName name, uint64_t start)
+      : call_(call), name_(name), start_(start) {}
+  TraceSpan(const TraceSpan &) = delete;
+  ~TraceSpan() {
+    if (call_) {
+      Tracer::Instance().Record(name_, call_, start_, trace_clock());
+    }
+  }
+};
@@ -0,0 +1,1036 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "buffers.h"
+#include "metrics.h"
+#include "pool.h"
+#include "trace.h"
+#include "workers.h"
+
+// Event driven upstream (ASR side) I/O: every loop owns an epoll instance and
+// the sockets assigned to it, websocket workers only enqueue frames.
+
+enum class UpstreamState : int {
+  Connecting = 0,
+  Handshaking = 1,
+  Streaming = 2,
+  Failed = 3,
+  Closed = 4
+};
+
+struct BreakerOptions final {
+  // Consecutive connect/handshake failures that eject a node
+  uint32_t failures = 3;
+  int eject_ms = 5000;
+  int max_eject_ms = 60000;
+  // Handshakes slower than this count as failures, 0 disables
+  int slow_handshake_ms = 0;
+};
+
+// What to do with a frame when the channel buffer is full
+enum class OverflowPolicy {
+  Disconnect, // fail the call
+  DropOldest, // drop the oldest unsent frames
+  Block       // hold the websocket worker up to the write timeout
+};
+
+inline bool parse_overflow_policy(const std::string &name,
+                                  OverflowPolicy &policy) {
+  if (name == "disconnect") {
+    policy = OverflowPolicy::Disconnect;
+  } else if (name == "drop_oldest") {
+    policy = OverflowPolicy::DropOldest;
+  } else if (name == "block") {
+    policy = OverflowPolicy::Block;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+struct UpstreamOptions final {
+  int threads = 0; // 0 - one loop per core
+  size_t max_queue_bytes = 1 << 20;
+  OverflowPolicy overflow = OverflowPolicy::Disconnect;
+  int connect_timeout_ms = 1000;
+  int handshake_timeout_ms = 1000;
+  int write_timeout_ms = 15000;
+  // Small frames wait up to batch_delay_ms to be coalesced into one sendmsg,
+  // unless batch_bytes are already queued
+  int batch_delay_ms = 0;
+  size_t batch_bytes = 8 * 1024;
+  // Result lines from the node waiting for the PBX, oldest dropped past it
+  size_t max_result_bytes = 64 * 1024;
+  BreakerOptions breaker;
+};
+
+// Live counters and circuit breaker of one ASR node, shared by every selector
+// pointing to it
+struct NodeStats final {
+  // While half open only one call per trial window may try the node
+  static constexpr int64_t kTrialMs = 1000;
+
+  std::atomic<int32_t> active_streams{0};
+  std::atomic<uint64_t> handshake_us{0}; // moving average
+  std::atomic<uint32_t> failures{0};     // consecutive
+  std::atomic<int64_t> ejected_until_ms{0};
+  ShardedCounter bytes;
+  ShardedCounter frames;
+  // Same node in the segment of a multi process router, nullptr otherwise
+  SharedNodeSlot *shared = nullptr;
+  // Counts already added to the shared slot, owned by the publisher
+  uint64_t published_frames = 0;
+  uint64_t published_bytes = 0;
+  // Resolved off the call path, null until a lookup succeeded
+  std::shared_ptr<const UpstreamAddress> address;
+
+  static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  std::shared_ptr<const UpstreamAddress> Address() const {
+    return std::atomic_load(&address);
+  }
+  // Blocking lookup, a failed one keeps the last address
+  void Resolve(const std::string &host, uint16_t port) {
+    auto next = std::make_shared<UpstreamAddress>();
+    std::string error;
+    if (resolve_upstream(host, port, *next, error)) {
+      std::atomic_store(
+          &address, std::shared_ptr<const UpstreamAddress>(std::move(next)));
+    }
+  }
+
+  void StreamOpened() {
+    active_streams++;
+    if (shared) {
+      shared->active_streams++;
+      shared->worker_streams[SharedCounters::WorkerIndex()]++;
+    }
+  }
+  void StreamClosed() {
+    active_streams--;
+    if (shared) {
+      shared->active_streams--;
+      shared->worker_streams[SharedCounters::WorkerIndex()]--;
+    }
+  }
+  // Streams of every worker when they share counters, used for balancing
+  int32_t Streams() const {
+    return shared ? shared->active_streams.load(std::memory_order_relaxed)
+                  : active_streams.load(std::memory_order_relaxed);
+  }
+
+  bool Ejected() const {
+    auto until = ejected_until_ms.load(std::memory_order_relaxed);
+    return until != 0 && now_ms() < until;
+  }
+  // Claims a call for the node, false while the breaker is open
+  bool Admit() {
+    auto until = ejected_until_ms.load();
+    if (until == 0) {
+      return true;
+    }
+    auto now = now_ms();
+    if (now < until) {
+      return false;
+    }
+    return ejected_until_ms.compare_exchange_strong(until, now + kTrialMs);
+  }
+  void Readmit() {
+    ejected_until_ms = 0;
+    failures = 0;
+  }
+
+  void HandshakeDone(uint64_t us, const BreakerOptions &options) {
+    auto prev = handshake_us.load(std::memory_order_relaxed);
+    auto next = prev == 0 ? us : (prev * 7 + us) / 8;
+    handshake_us.store(next, std::memory_order_relaxed);
+    if (options.slow_handshake_ms > 0 &&
+        us > uint64_t(options.slow_handshake_ms) * 1000) {
+      HandshakeFailed(options);
+      return;
+    }
+    Readmit();
+  }
+  void HandshakeFailed(const BreakerOptions &options) {
+    auto count = ++failures;
+    if (count < options.failures) {
+      return;
+    }
+    // Every failure past the threshold doubles the ejection
+    auto shift = std::min<uint32_t>(count - options.failures, 6);
+    auto eject = std::min<int64_t>(options.max_eject_ms,
+                                   int64_t(options.eject_ms) << shift);
+    ejected_until_ms = now_ms() + eject;
+  }
+};
+
+class UpstreamLoop;
+
+class UpstreamConnection final
+    : public std::enable_shared_from_this<UpstreamConnection> {
+  friend class UpstreamLoop;
+  friend class UpstreamEngine;
+
+  UpstreamLoop &loop_;
+  const size_t max_queue_bytes_;
+  std::atomic<UpstreamState> state_{UpstreamState::Connecting};
+  std::atomic<bool> scheduled_{false};
+  std::atomic<bool> closing_{false};
+  std::atomic<bool> handshaked_{false};
+
+  // Guarded by mutex_, producers only append to the queue
+  std::mutex mutex_;
+  FrameRing queue_;
+  size_t queue_bytes_ = 0;
+  size_t inflight_ = 0; // front blocks the loop is writing without the lock
+  size_t high_water_bytes_ = 0;
+  uint64_t dropped_bytes_ = 0;
+  uint32_t waiters_ = 0;
+  std::condition_variable space_;
+  std::string error_;
+  std::deque<std::pair<std::string, std::chrono::steady_clock::time_point>>
+      results_;
+  size_t results_bytes_ = 0;
+  // Last audio queued, results are timed against it
+  std::atomic<int64_t> last_audio_ns_{0};
+
+  // Owned by the loop thread
+  int fd_ = -1;
+  bool registered_ = false;
+  bool want_write_ = false;
+  std::string handshake_;
+  size_t handshake_sent_ = 0;
+  size_t head_offset_ = 0; // bytes of the front block already written
+  std::chrono::steady_clock::time_point deadline_;
+  std::chrono::steady_clock::time_point started_;
+  std::shared_ptr<NodeStats> stats_;
+  // Node address for a redial when a pooled socket turns out to be stale
+  std::shared_ptr<const UpstreamAddress> address_;
+  bool warm_ = false;
+  // Sampled calls record connect and handshake spans, phase start in ticks
+  uint64_t trace_id_ = 0;
+  uint64_t trace_ticks_ = 0;
+  std::string result_line_;
+  // Called by the loop when results were queued, set before the first
+  // Schedule and never changed
+  std::function<void()> on_results_;
+
+public:
+  UpstreamConnection(UpstreamLoop &loop, int fd, std::string handshake,
+                     size_t max_queue_bytes)
+      : loop_(loop), max_queue_bytes_(max_queue_bytes),
+        queue_(2 * (max_queue_bytes / FrameBlock::kSize) + 3), fd_(fd),
+        handshake_(std::move(handshake)) {}
+  UpstreamConnection(const UpstreamConnection &) = delete;
+
+  // Queue a frame for the upstream, false if the connection is dead or the
+  // queue is over its limit
+  bool Send(std::string_view data);
+  // Flush queued frames and close the socket
+  void Close();
+
+  UpstreamState State() const { return state_.load(); }
+  bool Failed() const { return state_.load() == UpstreamState::Failed; }
+  // False if the node never accepted the call, the audio is still queued
+  bool Handshaked() const { return handshaked_.load(); }
+  std::string Error() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+  }
+  size_t QueuedBytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_bytes_;
+  }
+  size_t HighWaterBytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return high_water_bytes_;
+  }
+  uint64_t DroppedBytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_bytes_;
+  }
+  // Moves the result lines read so far to out with their arrival time,
+  // false if there are none
+  bool TakeResults(
+      std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>>
+          &out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (results_.empty()) {
+      return false;
+    }
+    for (auto &result : results_) {
+      out.push_back(std::move(result));
+    }
+    results_.clear();
+    results_bytes_ = 0;
+    return true;
+  }
+
+private:
+  // Drops the oldest block nobody is writing, false if there is none.
+  // Must be called with mutex_ held.
+  bool DropOldest() {
+    size_t index = inflight_;
+    if (index == 0 && head_offset_ > 0) {
+      // The front frame is partially sent already
+      index = 1;
+    }
+    if (index >= queue_.Count()) {
+      return false;
+    }
+    auto bytes = queue_.At(index)->size;
+    queue_.Erase(index);
+    queue_bytes_ -= bytes;
+    dropped_bytes_ += bytes;
+    return true;
+  }
+};
+
+class UpstreamLoop final {
+  static constexpr int kTickMs = 50;
+  static constexpr int kMaxEvents = 256;
+  static constexpr int kMaxIov = 64;
+
+  const UpstreamOptions options_;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::atomic<bool> stop_{false};
+  using clock = std::chrono::steady_clock;
+  using Scheduled =
+      std::pair<clock::time_point, std::shared_ptr<UpstreamConnection>>;
+  struct Later {
+    bool operator()(const Scheduled &a, const Scheduled &b) const {
+      return a.first > b.first;
+    }
+  };
+
+  std::mutex mutex_;
+  std::vector<Scheduled> pending_;
+  // Owned by the loop thread
+  std::unordered_map<int, std::shared_ptr<UpstreamConnection>> conns_;
+  std::priority_queue<Scheduled, std::vector<Scheduled>, Later> delayed_;
+  std::thread thread_;
+
+  void SetInterest(UpstreamConnection &conn, bool write) {
+    epoll_event ev{};
+    ev.events = uint32_t(EPOLLIN) | uint32_t(EPOLLRDHUP) |
+                (write ? uint32_t(EPOLLOUT) : 0u);
+    ev.data.fd = conn.fd_;
+    if (!conn.registered_) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn.fd_, &ev);
+      conn.registered_ = true;
+    } else if (conn.want_write_ != write) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd_, &ev);
+    }
+    conn.want_write_ = write;
+  }
+
+  void Release(UpstreamConnection &conn, UpstreamState state,
+               const std::string &reason) {
+    if (conn.fd_ >= 0) {
+      if (conn.registered_) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd_, nullptr);
+      }
+      conns_.erase(conn.fd_);
+      close(conn.fd_);
+      conn.fd_ = -1;
+    }
+    {
+      std::lock_guard<std::mutex> lock(conn.mutex_);
+      // Audio of a call that never reached the node is kept for a failover
+      if (conn.handshaked_ || state != UpstreamState::Failed) {
+        conn.queue_.Clear();
+        conn.queue_bytes_ = 0;
+      }
+      if (!reason.empty()) {
+        conn.error_ = reason;
+      }
+      conn.state_ = state;
+    }
+    conn.space_.notify_all();
+  }
+  // A pooled socket the peer dropped while idle is not a node failure:
+  // swap it for a fresh connect once, only that one counts on the breaker.
+  // The address was cached at Connect, the loop never resolves.
+  bool Redial(UpstreamConnection &conn) {
+    if (!conn.warm_ || conn.handshaked_ || conn.closing_ || conn.fd_ < 0 ||
+        !conn.address_) {
+      return false;
+    }
+    conn.warm_ = false;
+    std::string error;
+    int fd = open_upstream_socket(*conn.address_, error);
+    if (fd < 0) {
+      return false;
+    }
+    auto self = conns_.at(conn.fd_);
+    if (conn.registered_) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd_, nullptr);
+    }
+    conns_.erase(conn.fd_);
+    close(conn.fd_);
+    RouterMetrics::Instance().pool_stale.Add(1);
+    conn.fd_ = fd;
+    conn.registered_ = false;
+    conn.want_write_ = false;
+    conn.handshake_sent_ = 0;
+    conn.state_ = UpstreamState::Connecting;
+    conn.deadline_ =
+        clock::now() + std::chrono::milliseconds(options_.connect_timeout_ms);
+    conns_[fd] = std::move(self);
+    SetInterest(conn, true);
+    return true;
+  }
+  void Fail(UpstreamConnection &conn, ErrorType type,
+            const std::string &reason) {
+    if (Redial(conn)) {
+      return;
+    }
+    RouterMetrics::Instance().Error(type);
+    if (!conn.handshaked_ && conn.stats_) {
+      conn.stats_->HandshakeFailed(options_.breaker);
+    }
+    Release(conn, UpstreamState::Failed, reason);
+  }
+
+  void Handshake(UpstreamConnection &conn) {
+    while (conn.handshake_sent_ < conn.handshake_.size()) {
+      auto n = send(conn.fd_, conn.handshake_.data() + conn.handshake_sent_,
+                    conn.handshake_.size() - conn.handshake_sent_,
+                    MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          SetInterest(conn, true);
+          return;
+        }
+        Fail(conn, ErrorType::Handshake,
+             std::string("handshake write: ") + std::strerror(errno));
+        return;
+      }
+      conn.handshake_sent_ += n;
+    }
+    // Handshake is out, wait for the sync byte
+    SetInterest(conn, false);
+  }
+
+  void Flush(UpstreamConnection &conn) {
+    if (conn.state_ != UpstreamState::Streaming) {
+      return;
+    }
+    while (true) {
+      iovec iov[kMaxIov];
+      int iov_count = 0;
+      {
+        // Blocks stay in their ring slots and appends only grow the tail, so
+        // the loop may write the captured ranges without holding the lock
+        std::lock_guard<std::mutex> lock(conn.mutex_);
+        size_t offset = conn.head_offset_;
+        for (size_t i = 0; i < conn.queue_.Count() && iov_count < kMaxIov;
+             i++) {
+          auto &block = *conn.queue_.At(i);
+          if (block.size > offset) {
+            iov[iov_count].iov_base = block.data + offset;
+            iov[iov_count].iov_len = block.size - offset;
+            iov_count++;
+          }
+          offset = 0;
+          conn.inflight_ = i + 1;
+        }
+      }
+      if (iov_count == 0) {
+        {
+          std::lock_guard<std::mutex> lock(conn.mutex_);
+          conn.inflight_ = 0;
+        }
+        SetInterest(conn, false);
+        if (conn.closing_) {
+          Release(conn, UpstreamState::Closed, "");
+        }
+        return;
+      }
+      msghdr msg{};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iov_count;
+      auto write_start = clock::now();
+      ssize_t n;
+      {
+        TraceSpan span(conn.trace_id_, TraceName::Write);
+        n = sendmsg(conn.fd_, &msg, MSG_NOSIGNAL);
+      }
+      RouterMetrics::Instance().write_latency.Observe(
+          std::chrono::duration_cast<std::chrono::microseconds>(clock::now() -
+                                                                write_start)
+              .count());
+      if (n < 0) {
+        {
+          std::lock_guard<std::mutex> lock(conn.mutex_);
+          conn.inflight_ = 0;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          if (!conn.want_write_) {
+            conn.deadline_ =
+                clock::now() +
+                std::chrono::milliseconds(options_.write_timeout_ms);
+          }
+          SetInterest(conn, true);
+          return;
+        }
+        Fail(conn, ErrorType::Write,
+             std::string("upstream write: ") + std::strerror(errno));
+        return;
+      }
+      // Progress resets the stall deadline
+      conn.deadline_ =
+          clock::now() + std::chrono::milliseconds(options_.write_timeout_ms);
+      std::lock_guard<std::mutex> lock(conn.mutex_);
+      conn.inflight_ = 0;
+      if (conn.waiters_ > 0) {
+        conn.space_.notify_all();
+      }
+      size_t written = static_cast<size_t>(n);
+      conn.queue_bytes_ -= written;
+      while (!conn.queue_.Empty()) {
+        auto &front = conn.queue_.Front();
+        auto left = front->size - conn.head_offset_;
+        if (written < left) {
+          conn.head_offset_ += written;
+          break;
+        }
+        written -= left;
+        if (conn.queue_.Count() > 1 || front->Free() == 0) {
+          conn.queue_.Pop();
+          conn.head_offset_ = 0;
+        } else {
+          // Sole block is drained, rewind it unless someone else holds it
+          if (front->refs == 1) {
+            front->size = 0;
+            conn.head_offset_ = 0;
+          } else {
+            conn.head_offset_ = front->size;
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  // Queues the complete line in result_line_ for the PBX
+  void QueueResult(UpstreamConnection &conn, clock::time_point now) {
+    auto &metrics = RouterMetrics::Instance();
+    auto audio_ns = conn.last_audio_ns_.load(std::memory_order_relaxed);
+    if (audio_ns > 0) {
+      auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        now.time_since_epoch())
+                        .count();
+      metrics.result_latency.Observe(std::max<int64_t>(0, now_ns - audio_ns) /
+                                     1000);
+    }
+    const auto limit = options_.max_result_bytes;
+    std::lock_guard<std::mutex> lock(conn.mutex_);
+    conn.results_bytes_ += conn.result_line_.size();
+    conn.results_.emplace_back(std::move(conn.result_line_), now);
+    conn.result_line_.clear();
+    while (conn.results_bytes_ > limit && conn.results_.size() > 1) {
+      // Newer hypotheses supersede the ones the PBX did not pick up
+      conn.results_bytes_ -= conn.results_.front().first.size();
+      conn.results_.pop_front();
+      metrics.results_dropped.Add(1);
+    }
+  }
+
+  // Nodes answer with newline delimited results, each complete line is
+  // queued for the PBX
+  void OnResults(UpstreamConnection &conn, const char *data, size_t size) {
+    auto now = clock::now();
+    const auto limit = options_.max_result_bytes;
+    bool queued = false;
+    while (size > 0) {
+      auto end = static_cast<const char *>(std::memchr(data, '\n', size));
+      size_t n = end ? end - data : size;
+      // A line longer than the queue is cut there
+      conn.result_line_.append(
+          data, std::min(n, limit - std::min(limit, conn.result_line_.size())));
+      data += end ? n + 1 : n;
+      size -= end ? n + 1 : n;
+      if (!end) {
+        break;
+      }
+      if (!conn.result_line_.empty()) {
+        QueueResult(conn, now);
+        queued = true;
+      }
+    }
+    if (queued && conn.on_results_) {
+      conn.on_results_();
+    }
+  }
+  // The node closed the stream, its last line may lack the newline
+  void OnResultsEnd(UpstreamConnection &conn) {
+    if (conn.result_line_.empty()) {
+      return;
+    }
+    QueueResult(conn, clock::now());
+    if (conn.on_results_) {
+      conn.on_results_();
+    }
+  }
+
+  void OnEvent(UpstreamConnection &conn, uint32_t events) {
+    if (conn.state_ == UpstreamState::Connecting) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(conn.fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+        Fail(conn, ErrorType::Connect, std::string("upstream connect: ") +
+                       std::strerror(err ? err : ECONNREFUSED));
+        return;
+      }
+      if (!(events & EPOLLOUT)) {
+        return;
+      }
+      conn.state_ = UpstreamState::Handshaking;
+      if (conn.trace_id_) {
+        auto now = trace_clock();
+        Tracer::Instance().Record(TraceName::Connect, conn.trace_id_,
+                                  conn.trace_ticks_, now);
+        conn.trace_ticks_ = now;
+      }
+      conn.deadline_ = clock::now() +
+                       std::chrono::milliseconds(options_.handshake_timeout_ms);
+      Handshake(conn);
+      return;
+    }
+    if (conn.state_ == UpstreamState::Handshaking) {
+      if (conn.handshake_sent_ < conn.handshake_.size()) {
+        if (events & EPOLLOUT) {
+          Handshake(conn);
+        }
+        if (conn.state_ != UpstreamState::Handshaking ||
+            conn.handshake_sent_ < conn.handshake_.size()) {
+          return;
+        }
+      }
+      if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return;
+      }
+      uint8_t sync = 0;
+      auto n = recv(conn.fd_, &sync, 1, 0);
+      if (n == 1) {
+        auto latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                              clock::now() - conn.started_)
+                              .count();
+        RouterMetrics::Instance().handshake_latency.Observe(latency_us);
+        if (conn.trace_id_) {
+          Tracer::Instance().Record(TraceName::SyncWait, conn.trace_id_,
+                                    conn.trace_ticks_, trace_clock());
+        }
+        if (conn.stats_) {
+          conn.stats_->HandshakeDone(latency_us, options_.breaker);
+        }
+        conn.handshaked_ = true;
+        conn.state_ = UpstreamState::Streaming;
+        conn.handshake_.clear();
+        conn.handshake_.shrink_to_fit();
+        Flush(conn);
+      } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        Fail(conn, ErrorType::Handshake, "upstream closed during handshake");
+      }
+      return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      // Results from the node, or the peer going away
+      char buffer[4096];
+      while (true) {
+        auto n = recv(conn.fd_, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+          OnResults(conn, buffer, n);
+          continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+          OnResultsEnd(conn);
+          Fail(conn, ErrorType::UpstreamClosed,
+               "upstream closed the connection");
+          return;
+        }
+        break;
+      }
+    }
+    if (events & EPOLLOUT) {
+      Flush(conn);
+    }
+  }
+
+  void Process(const std::shared_ptr<UpstreamConnection> &conn) {
+    if (conn->fd_ < 0) {
+      return;
+    }
+    if (!conn->registered_) {
+      conns_[conn->fd_] = conn;
+      if (conn->state_ == UpstreamState::Handshaking) {
+        // Warm socket from the pool, go straight to the handshake
+        conn->deadline_ = clock::now() + std::chrono::milliseconds(
+                                             options_.handshake_timeout_ms);
+        Handshake(*conn);
+        if (conn->fd_ < 0) {
+          return;
+        }
+      } else {
+        conn->deadline_ = clock::now() + std::chrono::milliseconds(
+                                             options_.connect_timeout_ms);
+        SetInterest(*conn, true);
+      }
+    }
+    if (conn->closing_ && conn->state_ != UpstreamState::Streaming &&
+        conn->QueuedBytes() == 0) {
+      // Nothing to deliver, no need to finish the handshake
+      Release(*conn, UpstreamState::Closed, "");
+      return;
+    }
+    if (!conn->want_write_) {
+      Flush(*conn);
+    }
+  }
+
+  void RunPending() {
+    std::vector<Scheduled> pending;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending.swap(pending_);
+    }
+    auto now = clock::now();
+    for (auto &item : pending) {
+      if (item.first > now && !item.second->closing_) {
+        delayed_.push(std::move(item));
+        continue;
+      }
+      item.second->scheduled_ = false;
+      Process(item.second);
+    }
+    while (!delayed_.empty() && delayed_.top().first <= now) {
+      auto conn = delayed_.top().second;
+      delayed_.pop();
+      conn->scheduled_ = false;
+      Process(conn);
+    }
+  }
+
+  int WaitTimeoutMs() const {
+    if (delayed_.empty()) {
+      return kTickMs;
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    delayed_.top().first - clock::now())
+                    .count() +
+                1;
+    return static_cast<int>(std::max<long>(0, std::min<long>(kTickMs, left)));
+  }
+
+  void CheckDeadlines() {
+    auto now = clock::now();
+    std::vector<std::shared_ptr<UpstreamConnection>> expired;
+    for (auto &[fd, conn] : conns_) {
+      bool waiting = conn->state_ != UpstreamState::Streaming ||
+                     conn->want_write_;
+      if (waiting && now > conn->deadline_) {
+        expired.push_back(conn);
+      }
+    }
+    for (auto &conn : expired) {
+      switch (conn->state_.load()) {
+      case UpstreamState::Connecting:
+        Fail(*conn, ErrorType::Connect, "upstream connect timeout");
+        break;
+      case UpstreamState::Handshaking:
+        Fail(*conn, ErrorType::Handshake, "upstream handshake timeout");
+        break;
+      default:
+        Fail(*conn, ErrorType::Write, "upstream write timeout");
+      }
+    }
+  }
+
+  void Run() {
+    epoll_event events[kMaxEvents];
+    auto last_check = clock::now();
+    while (!stop_) {
+      int n = epoll_wait(epoll_fd_, events, kMaxEvents, WaitTimeoutMs());
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == wake_fd_) {
+          uint64_t value;
+          while (read(wake_fd_, &value, sizeof(value)) > 0) {
+          }
+          continue;
+        }
+        auto it = conns_.find(events[i].data.fd);
+        if (it == conns_.end()) {
+          continue;
+        }
+        auto conn = it->second;
+        OnEvent(*conn, events[i].events);
+      }
+      RunPending();
+      auto now = clock::now();
+      if (now - last_check > std::chrono::milliseconds(kTickMs)) {
+        CheckDeadlines();
+        last_check = now;
+      }
+    }
+    for (auto &[fd, conn] : conns_) {
+      close(fd);
+      conn->fd_ = -1;
+      conn->state_ = UpstreamState::Closed;
+    }
+    conns_.clear();
+  }
+
+public:
+  explicit UpstreamLoop(UpstreamOptions options) : options_(options) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+    thread_ = std::thread([this]() { Run(); });
+  }
+  UpstreamLoop(const UpstreamLoop &) = delete;
+  ~UpstreamLoop() {
+    stop_ = true;
+    Wake();
+    thread_.join();
+    close(wake_fd_);
+    close(epoll_fd_);
+  }
+
+  const UpstreamOptions &Options() const { return options_; }
+
+  void Wake() {
+    uint64_t one = 1;
+    (void)!write(wake_fd_, &one, sizeof(one));
+  }
+  // Flush the connection at `when`, an immediate request always goes through
+  // while delayed ones are collapsed
+  void Schedule(std::shared_ptr<UpstreamConnection> conn,
+                clock::time_point when = clock::time_point()) {
+    bool immediate = when == clock::time_point();
+    if (conn->scheduled_.exchange(true) && !immediate) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.emplace_back(when, std::move(conn));
+    }
+    Wake();
+  }
+};
+
+inline bool UpstreamConnection::Send(std::string_view data) {
+  auto state = state_.load();
+  if (state == UpstreamState::Failed || state == UpstreamState::Closed ||
+      closing_) {
+    return false;
+  }
+  last_audio_ns_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now().time_since_epoch())
+                           .count(),
+                       std::memory_order_relaxed);
+  bool was_empty = false;
+  bool batch_full = false;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto policy = loop_.Options().overflow;
+    std::chrono::steady_clock::time_point deadline;
+    while (queue_bytes_ + data.size() > max_queue_bytes_) {
+      if (policy == OverflowPolicy::DropOldest) {
+        if (DropOldest()) {
+          continue;
+        }
+        // Everything queued is on the wire already, drop this frame instead
+        dropped_bytes_ += data.size();
+        return true;
+      }
+      // Block also waits while connecting or handshaking, the queue drains
+      // once the node takes the call
+      auto live = [this]() {
+        auto current = state_.load();
+        return current != UpstreamState::Failed &&
+               current != UpstreamState::Closed;
+      };
+      if (policy == OverflowPolicy::Block && live()) {
+        if (deadline == std::chrono::steady_clock::time_point()) {
+          deadline =
+              std::chrono::steady_clock::now() +
+              std::chrono::milliseconds(loop_.Options().write_timeout_ms);
+        }
+        waiters_++;
+        space_.wait_until(lock, deadline, [this, &data, &live]() {
+          return queue_bytes_ + data.size() <= max_queue_bytes_ || !live();
+        });
+        waiters_--;
+        if (queue_bytes_ + data.size() <= max_queue_bytes_) {
+          break;
+        }
+        if (!live()) {
+          return false;
+        }
+      }
+      error_ = "upstream queue overflow";
+      RouterMetrics::Instance().Error(ErrorType::Overflow);
+      return false;
+    }
+    was_empty = queue_bytes_ == 0;
+    if (!queue_.Append(data.data(), data.size())) {
+      error_ = "upstream queue overflow";
+      RouterMetrics::Instance().Error(ErrorType::Overflow);
+      return false;
+    }
+    auto batch_bytes = loop_.Options().batch_bytes;
+    batch_full = queue_bytes_ < batch_bytes &&
+                 queue_bytes_ + data.size() >= batch_bytes;
+    queue_bytes_ += data.size();
+    high_water_bytes_ = std::max(high_water_bytes_, queue_bytes_);
+    // Read again under the lock: the loop switches to streaming before it
+    // takes the lock to flush, so either it sees this frame or we see the
+    // new state and schedule
+    state = state_.load();
+  }
+  if (state != UpstreamState::Streaming) {
+    // The loop flushes everything once the handshake is done
+    return true;
+  }
+  auto delay = loop_.Options().batch_delay_ms;
+  if (delay <= 0 || batch_full) {
+    // The loop keeps draining a non empty queue on its own
+    if (was_empty || batch_full) {
+      loop_.Schedule(shared_from_this());
+    }
+  } else if (was_empty) {
+    loop_.Schedule(shared_from_this(), std::chrono::steady_clock::now() +
+                                           std::chrono::milliseconds(delay));
+  }
+  return true;
+}
+
+inline void UpstreamConnection::Close() {
+  if (closing_.exchange(true)) {
+    return;
+  }
+  loop_.Schedule(shared_from_this());
+}
+
+class UpstreamEngine final {
+  const UpstreamOptions options_;
+  std::vector<std::unique_ptr<UpstreamLoop>> loops_;
+  std::atomic<size_t> next_loop_{0};
+
+  ConnectionPool pool_;
+
+public:
+  UpstreamEngine(UpstreamOptions options, PoolOptions pool_options)
+      : options_(options), pool_(pool_options) {
+    int threads = options_.threads;
+    if (threads <= 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (int i = 0; i < threads; i++) {
+      loops_.push_back(std::make_unique<UpstreamLoop>(options_));
+    }
+  }
+  UpstreamEngine(const UpstreamEngine &) = delete;
+
+  // Nodes to keep warm sockets for
+  void SetNodes(const std::vector<std::pair<std::string, uint16_t>> &nodes) {
+    pool_.SetNodes(nodes);
+  }
+
+  // Retries a call that failed before the handshake on another node, the
+  // handshake and the queued audio move to the new connection
+  std::shared_ptr<UpstreamConnection>
+  Reconnect(UpstreamConnection &failed, const std::string &host,
+            uint16_t port, std::shared_ptr<NodeStats> stats = nullptr) {
+    auto conn = Connect(host, port, failed.handshake_, std::move(stats),
+                        failed.trace_id_, failed.on_results_);
+    {
+      std::scoped_lock lock(failed.mutex_, conn->mutex_);
+      std::swap(conn->queue_, failed.queue_);
+      std::swap(conn->queue_bytes_, failed.queue_bytes_);
+    }
+    return conn;
+  }
+
+  // Starts a non blocking connect and handshake, frames may be queued on the
+  // returned connection right away. on_results runs on the loop thread
+  // whenever result lines were queued.
+  std::shared_ptr<UpstreamConnection>
+  Connect(const std::string &host, uint16_t port, std::string handshake,
+          std::shared_ptr<NodeStats> stats = nullptr, uint64_t trace_id = 0,
+          std::function<void()> on_results = nullptr) {
+    auto &loop = *loops_[next_loop_++ % loops_.size()];
+    std::string error;
+    bool warm = true;
+    // The registry resolves nodes on routing updates, never this thread
+    auto address = stats ? stats->Address() : nullptr;
+    int fd = pool_.Take(host, port);
+    if (fd < 0) {
+      warm = false;
+      if (address) {
+        fd = open_upstream_socket(*address, error);
+      } else {
+        error = "can't resolve " + host;
+      }
+    }
+    auto conn = std::make_shared<UpstreamConnection>(
+        loop, fd, std::move(handshake), options_.max_queue_bytes);
+    conn->started_ = std::chrono::steady_clock::now();
+    conn->stats_ = std::move(stats);
+    conn->trace_id_ = trace_id;
+    conn->trace_ticks_ = trace_id ? trace_clock() : 0;
+    conn->address_ = std::move(address);
+    conn->warm_ = warm;
+    conn->on_results_ = std::move(on_results);
+    if (warm) {
+      conn->state_ = UpstreamState::Handshaking;
+    }
+    if (fd < 0) {
+      if (conn->stats_) {
+        conn->stats_->HandshakeFailed(options_.breaker);
+      }
+      conn->error_ = error;
+      conn->state_ = UpstreamState::Failed;
+      return conn;
+    }
+    loop.Schedule(conn);
+    return conn;
+  }
+};
@@ -4,6 +4,11 @@ PLS_INCLUDE_HEADER_ONLY_CURRENT();
 PLS_ADD_DEP("websockets", "https://github.com/current-deps/websockets");
 PLS_ADD_DEP("redis", "https://github.com/current-deps/redis");
 
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <csignal>
+
 #include "router.h"
 #include "vocallout.h"
 const std::string VERSION = "Vocallout v.1.1.14 Beta";
@@ -17,6 +22,65 @@ DEFINE_int32(n_threads, 128, "Max number of worker threads");
 DEFINE_int32(timeout_ms, 5000, "Websocket timeout in milliseconds");
 DEFINE_int32(read_timeout_sec, 1, "AI engine read tiemout in seconds");
 DEFINE_int32(write_timeout_sec, 15, "AI engine write timeout in seconds");
+DEFINE_int32(upstream_threads, 0,
+             "Upstream event loops, 0 means one loop per core");
+DEFINE_uint32(buffer_ms, 16000, "Max audio buffered per channel in ms");
+DEFINE_uint32(audio_bytes_per_ms, 64,
+              "Upstream audio rate used to size the buffers, 64 is 16kHz f32");
+DEFINE_string(overflow_policy, "disconnect",
+              "Full channel buffer: disconnect, drop_oldest or block");
+DEFINE_int32(upstream_batch_ms, 0,
+             "Max delay to coalesce small frames into one upstream write");
+DEFINE_uint32(pool_min_idle, 0,
+              "Pre-connected sockets kept per AI engine node, 0 disables");
+DEFINE_uint32(pool_max_idle, 8, "Max idle sockets kept per AI engine node");
+DEFINE_int32(pool_check_ms, 1000, "Idle socket health check interval");
+DEFINE_string(balancer, "round_robin",
+              "Node selection: round_robin (weighted), least_streams or p2c");
+DEFINE_int32(failover_ms, 2000,
+             "Time to retry a failed handshake on other nodes");
+DEFINE_uint32(breaker_failures, 3,
+              "Consecutive handshake failures that eject a node");
+DEFINE_int32(breaker_eject_ms, 5000, "Initial node ejection time");
+DEFINE_int32(slow_handshake_ms, 0,
+             "Handshakes slower than this count as failures, 0 disables");
+DEFINE_int32(probe_interval_ms, 0,
+             "TCP probe interval for ejected nodes, 0 disables");
+DEFINE_string(tap_dir, "",
+              "Directory for WAV recordings of sampled calls, empty disables");
+DEFINE_string(tap_selectors, "",
+              "Comma separated selectors to record, empty records all");
+DEFINE_double(tap_sample, 1.0, "Fraction of calls recorded by the tap");
+DEFINE_uint32(tap_segment_sec, 300, "Max length of a recording file");
+DEFINE_uint32(tap_queue_blocks, 4096,
+              "16 KB blocks queued for the tap writer before dropping");
+DEFINE_bool(vad, false,
+            "Replace silence with markers on nodes with a framed wire format");
+DEFINE_double(vad_threshold_db, -45, "VAD speech level in dBFS");
+DEFINE_uint32(vad_hangover_ms, 300, "Audio still forwarded after speech");
+DEFINE_double(trace_sample, 0.01,
+              "Fraction of calls recording hot path spans for /trace");
+DEFINE_uint32(result_queue_bytes, 65536,
+              "Node result lines kept per call until the PBX gets them");
+DEFINE_bool(push_results, false,
+            "Send node results from a relay thread as they arrive, needs a "
+            "websockets client whose Send is safe outside its callbacks");
+DEFINE_string(capture_file, "",
+              "File recording calls for ./replay, empty disables");
+DEFINE_bool(capture_audio, false,
+            "Keep the audio in the capture, only frame sizes otherwise");
+DEFINE_double(capture_sample, 1.0, "Fraction of calls captured");
+DEFINE_uint32(capture_queue_records, 65536,
+              "Records queued for the capture writer before dropping");
+DEFINE_int32(drain_timeout_sec, 300,
+             "Max time live calls get to finish on /drain or SIGTERM");
+DEFINE_int32(workers, 1,
+             "Router processes, worker i takes port + i and http_port + 1 + i");
+DEFINE_bool(pin_cpus, true, "Pin every worker to its own slice of the cpus");
+DEFINE_int32(worker_index, -1, "Set by the master for its workers");
+DEFINE_int32(shm_fd, -1, "Shared counters of the workers, set by the master");
+
+volatile std::sig_atomic_t drain_signal = 0;
 
 std::string read_config(std::string path) {
   std::ifstream reader(path);
@@ -30,32 +94,255 @@ std::string read_config(std::string path) {
 }
 
 std::map<std::string, std::vector<VONode>>
-load_and_parse_config(std::string path) {
+load_and_parse_config(std::string path,
+                      std::map<std::string, TenantLimits> &limits) {
   auto conf = read_config(path);
   auto result = parse_config(conf);
-  if (!result.first) {
+  auto parsed_limits = parse_limits(conf);
+  if (!result.first || !parsed_limits.first) {
     exit(1);
   }
+  limits = std::move(parsed_limits.second);
   return result.second;
 }
 
+// Checks the api_token header of an admin request, answers it if refused
+bool authorized(Request &r) {
+  if (!FLAGS_api_token.empty() &&
+      (!r.headers.Has("api_token") ||
+       (FLAGS_api_token != r.headers["api_token"].value))) {
+    r(VOResponse::Error("invalid token"), HTTPResponseCode.Forbidden);
+    return false;
+  }
+  return true;
+}
+
+// Drain and shutdown of a router, Join blocks on the redis sync meanwhile
+void lifecycle(StreamRouter &router, std::atomic<bool> &stop) {
+  auto shared = SharedCounters::Attached();
+  while (!stop) {
+    sleep(1);
+    if (shared) {
+      router.PublishShared(*shared, SharedCounters::WorkerIndex());
+      if (shared->stop) {
+        router.BreakConnections();
+        stop = true;
+        break;
+      }
+      if (shared->drain && !router.Draining()) {
+        router.Drain(shared->drain_timeout_sec);
+      }
+    }
+    if (drain_signal && !router.Draining()) {
+      router.Drain(FLAGS_drain_timeout_sec);
+    }
+    if (router.Drained()) {
+      // Calls still live at the deadline are closed on their next frame
+      router.BreakConnections();
+      stop = true;
+    }
+  }
+}
+
+// Multi process mode: execs the workers, restarts the ones that die and
+// serves the aggregated /metrics. Drain and stop go to every worker.
+int run_master(const std::vector<std::string> &args) {
+  int fd = -1;
+  auto counters = SharedCounters::Create(fd);
+  const int workers =
+      std::min<int>(FLAGS_workers, SharedCounters::kMaxWorkers);
+  counters->workers = workers;
+  std::vector<std::vector<std::string>> worker_args(workers, args);
+  for (int i = 0; i < workers; i++) {
+    worker_args[i].push_back("--worker_index=" + std::to_string(i));
+    worker_args[i].push_back("--shm_fd=" + std::to_string(fd));
+  }
+  std::vector<pid_t> pids(workers, 0);
+  auto spawn = [&](int i) {
+    // argv is built before the fork, the child only execs
+    std::vector<char *> argv;
+    for (auto &arg : worker_args[i]) {
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    auto pid = fork();
+    if (pid == 0) {
+      execv("/proc/self/exe", argv.data());
+      _exit(127);
+    }
+    pids[i] = pid;
+    counters->worker[i].pid = pid;
+    std::cout << "Worker " << i << " started as " << pid << " on port "
+              << FLAGS_port + i << std::endl;
+  };
+  for (int i = 0; i < workers; i++) {
+    spawn(i);
+  }
+
+  try {
+    auto &http = HTTP(current::net::AcquireLocalPort(FLAGS_http_port));
+    auto scope = http.Register("/metrics", [counters](Request r) {
+      if (!authorized(r)) {
+        return;
+      }
+      if (r.method != "GET") {
+        r(VOResponse::Error("error: not supported"),
+          HTTPResponseCode.BadRequest);
+        return;
+      }
+      bool prometheus =
+          (r.url.query.has("format") &&
+           r.url.query["format"] == "prometheus") ||
+          (r.headers.Has("Accept") &&
+           (r.headers["Accept"].value.find("text/plain") != std::string::npos ||
+            r.headers["Accept"].value.find("openmetrics") !=
+                std::string::npos));
+      if (prometheus) {
+        r(shared_prometheus(*counters), HTTPResponseCode.OK,
+          current::net::http::Headers(), "text/plain; version=0.0.4");
+        return;
+      }
+      uint32_t live = 0;
+      for (uint32_t w = 0; w < counters->workers; w++) {
+        live += counters->worker[w].live_streams;
+      }
+      r(VOStatus::Response(counters->drain ? "draining" : "OK", live));
+    });
+    scope += http.Register("/stop", [counters](Request r) {
+      if (!authorized(r)) {
+        return;
+      }
+      counters->stop = 1;
+      r(VOResponse::OK("server stop"));
+    });
+    scope += http.Register("/drain", [counters](Request r) {
+      if (!authorized(r)) {
+        return;
+      }
+      int timeout_sec = FLAGS_drain_timeout_sec;
+      if (r.url.query.has("timeout_sec")) {
+        timeout_sec = std::atoi(r.url.query["timeout_sec"].c_str());
+      }
+      counters->drain_timeout_sec = timeout_sec;
+      counters->drain = 1;
+      r(VOResponse::OK("draining"));
+    });
+    std::cout << "Started http server on port " << FLAGS_http_port << std::endl;
+    std::signal(SIGTERM, [](int) { drain_signal = 1; });
+    while (true) {
+      int status = 0;
+      auto pid = waitpid(-1, &status, WNOHANG);
+      if (pid > 0) {
+        auto it = std::find(pids.begin(), pids.end(), pid);
+        if (it == pids.end()) {
+          continue;
+        }
+        int i = it - pids.begin();
+        *it = 0;
+        counters->Reap(i);
+        if (!counters->drain && !counters->stop) {
+          std::cout << "Worker " << i << " exited with status " << status
+                    << ", restarting" << std::endl;
+          sleep(1);
+          spawn(i);
+        }
+        continue;
+      }
+      if (std::all_of(pids.begin(), pids.end(),
+                      [](pid_t p) { return p == 0; })) {
+        break;
+      }
+      if (drain_signal && !counters->drain) {
+        counters->drain_timeout_sec = FLAGS_drain_timeout_sec;
+        counters->drain = 1;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    std::cout << "Safe shutdown" << std::endl;
+  } catch (current::net::SocketBindException const &) {
+    std::cout << "the local port " << FLAGS_http_port << " is already taken"
+              << std::endl;
+    counters->stop = 1;
+    for (auto pid : pids) {
+      if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+      }
+    }
+  }
+  return 0;
+}
+
 int main(int argc, char **argv) {
+  std::vector<std::string> args(argv, argv + argc);
   ParseDFlags(&argc, &argv);
 
   std::cout << VERSION << std::endl;
-  bool stop = false;
-  auto mapping = load_and_parse_config(FLAGS_config);
+  if (FLAGS_workers > 1 && FLAGS_worker_index < 0) {
+    return run_master(args);
+  }
+  if (FLAGS_worker_index >= 0) {
+    SharedCounters::Attached() = SharedCounters::Map(FLAGS_shm_fd);
+    SharedCounters::WorkerIndex() = FLAGS_worker_index;
+    // A worker without its master drains like on SIGTERM
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (FLAGS_pin_cpus) {
+      auto cpus = pin_worker(FLAGS_worker_index, FLAGS_workers);
+      if (FLAGS_upstream_threads == 0) {
+        FLAGS_upstream_threads = cpus;
+      }
+    }
+    FLAGS_port += FLAGS_worker_index;
+    FLAGS_http_port += 1 + FLAGS_worker_index;
+  }
+  std::atomic<bool> stop{false};
+  RouterSettings settings;
+  auto mapping = load_and_parse_config(FLAGS_config, settings.limits);
   auto ws_config = WSConfig::FromFields(
       FLAGS_host, FLAGS_port, FLAGS_n_threads, FLAGS_timeout_ms,
       FLAGS_read_timeout_sec, FLAGS_write_timeout_sec);
-  auto router = StreamRouter(mapping, ws_config);
+  auto &upstream = settings.upstream;
+  upstream.threads = FLAGS_upstream_threads;
+  upstream.buffer_ms = FLAGS_buffer_ms;
+  upstream.audio_bytes_per_ms = FLAGS_audio_bytes_per_ms;
+  upstream.overflow_policy = FLAGS_overflow_policy;
+  upstream.batch_ms = FLAGS_upstream_batch_ms;
+  upstream.result_queue_bytes = FLAGS_result_queue_bytes;
+  upstream.push_results = FLAGS_push_results;
+  upstream.pool_min_idle = FLAGS_pool_min_idle;
+  upstream.pool_max_idle = FLAGS_pool_max_idle;
+  upstream.pool_check_ms = FLAGS_pool_check_ms;
+  auto &balancer = settings.balancer;
+  balancer.policy = FLAGS_balancer;
+  balancer.failover_ms = FLAGS_failover_ms;
+  balancer.breaker_failures = FLAGS_breaker_failures;
+  balancer.breaker_eject_ms = FLAGS_breaker_eject_ms;
+  balancer.slow_handshake_ms = FLAGS_slow_handshake_ms;
+  balancer.probe_interval_ms = FLAGS_probe_interval_ms;
+  auto &tap = settings.tap;
+  tap.dir = FLAGS_tap_dir;
+  std::stringstream tap_selectors(FLAGS_tap_selectors);
+  for (std::string selector; std::getline(tap_selectors, selector, ',');) {
+    if (!selector.empty()) {
+      tap.selectors.insert(selector);
+    }
+  }
+  tap.sample = FLAGS_tap_sample;
+  tap.segment_sec = FLAGS_tap_segment_sec;
+  tap.queue_blocks = FLAGS_tap_queue_blocks;
+  settings.vad.enabled = FLAGS_vad;
+  settings.vad.threshold_db = FLAGS_vad_threshold_db;
+  settings.vad.hangover_ms = FLAGS_vad_hangover_ms;
+  settings.trace.sample = FLAGS_trace_sample;
+  auto &capture = settings.capture;
+  capture.path = FLAGS_capture_file;
+  capture.audio = FLAGS_capture_audio;
+  capture.sample = FLAGS_capture_sample;
+  capture.queue_records = FLAGS_capture_queue_records;
+  auto router = StreamRouter(mapping, ws_config, std::move(settings));
   try {
     auto &http = HTTP(current::net::AcquireLocalPort(FLAGS_http_port));
     auto scope = http.Register("/metrics", [&router](Request r) {
-      if (!FLAGS_api_token.empty() &&
-          (!r.headers.Has("api_token") ||
-           (FLAGS_api_token != r.headers["api_token"].value))) {
-        r(VOResponse::Error("invalid token"), HTTPResponseCode.Forbidden);
+      if (!authorized(r)) {
         return;
       }
       if (r.method != "GET") {
@@ -63,25 +350,61 @@ int main(int argc, char **argv) {
           HTTPResponseCode.BadRequest);
         return;
       }
-      r(VOStatus::Response("OK", router.StreamsCount()));
+      // Prometheus scrapers ask for text, everyone else gets the JSON status
+      bool prometheus =
+          (r.url.query.has("format") &&
+           r.url.query["format"] == "prometheus") ||
+          (r.headers.Has("Accept") &&
+           (r.headers["Accept"].value.find("text/plain") != std::string::npos ||
+            r.headers["Accept"].value.find("openmetrics") !=
+                std::string::npos));
+      if (prometheus) {
+        r(router.PrometheusMetrics(), HTTPResponseCode.OK,
+          current::net::http::Headers(), "text/plain; version=0.0.4");
+        return;
+      }
+      r(VOStatus::Response(router.Draining() ? "draining" : "OK",
+                           router.StreamsCount()));
     });
 
     scope += http.Register("/stop", [&router, &stop](Request r) {
-      if (!FLAGS_api_token.empty() &&
-          (!r.headers.Has("api_token") ||
-           (FLAGS_api_token != r.headers["api_token"].value))) {
-        r(VOResponse::Error("invalid token"), HTTPResponseCode.Forbidden);
+      if (!authorized(r)) {
         return;
       }
       router.BreakConnections();
       stop = true;
       r(VOResponse::OK("server stop"));
     });
+    scope += http.Register("/trace", [](Request r) {
+      if (!authorized(r)) {
+        return;
+      }
+      // Spans of sampled calls, ?call=<address:port> keeps a single call
+      uint64_t call = 0;
+      if (r.url.query.has("call")) {
+        call = Tracer::TraceId(r.url.query["call"]);
+      }
+      r(Tracer::Instance().ChromeJSON(call), HTTPResponseCode.OK,
+        current::net::http::Headers(), "application/json");
+    });
+    scope += http.Register("/drain", [&router](Request r) {
+      if (!authorized(r)) {
+        return;
+      }
+      int timeout_sec = FLAGS_drain_timeout_sec;
+      if (r.url.query.has("timeout_sec")) {
+        timeout_sec = std::atoi(r.url.query["timeout_sec"].c_str());
+      }
+      router.Drain(timeout_sec);
+      r(VOResponse::OK("draining"));
+    });
     std::cout << "Started http server on port " << FLAGS_http_port << std::endl;
+    // Orchestrators stop the router with SIGTERM, drain instead of dying
+    std::signal(SIGTERM, [](int) { drain_signal = 1; });
+    auto lifecycle_thread =
+        std::thread([&router, &stop]() { lifecycle(router, stop); });
     router.Join();
-    while (!stop) {
-      sleep(1);
-    }
+    lifecycle_thread.join();
     std::cout << "Safe shutdown" << std::endl;
   } catch (current::net::SocketBindException const &) {
     std::cout << "the local port " << FLAGS_http_port << " is already taken"
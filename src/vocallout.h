@@ -4,15 +4,32 @@
 #include "blocks/json/json.h"
 #include "bricks/dflags/dflags.h"
 #include "bricks/net/tcp/tcp.h"
-#include "bricks/sync/waitable_atomic.h"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <unordered_map>
 
 #include "src/websockets.h"
+#include "admission.h"
+#include "balancer.h"
+#include "capture.h"
+#include "dsp.h"
+#include "tap.h"
+#include "trace.h"
+#include "upstream.h"
 
 const std::string default_selector = "default";
+// Config key holding the tenant limits instead of a selector
+const std::string limits_key = "$limits";
 
 CURRENT_STRUCT(VONode) {
   CURRENT_FIELD(host, std::string);
   CURRENT_FIELD(port, uint16_t);
+  CURRENT_FIELD(weight, Optional<uint32_t>);
+  CURRENT_FIELD(wire_format, Optional<std::string>); // f32, s16 or ulaw
   static VONode Create(std::string host, uint16_t port) {
     VONode v;
     v.host = host;
@@ -21,6 +38,14 @@ CURRENT_STRUCT(VONode) {
   }
 };
 
+// Limits of an account id or a selector, missing fields are unlimited
+CURRENT_STRUCT(VOLimit) {
+  CURRENT_FIELD(streams, Optional<uint32_t>);
+  CURRENT_FIELD(calls_per_sec, Optional<double>);
+  CURRENT_FIELD(calls_burst, Optional<double>);
+  CURRENT_FIELD(bytes_per_sec, Optional<uint64_t>);
+};
+
 CURRENT_STRUCT(VOStatus) {
   CURRENT_FIELD(status, std::string);
   CURRENT_FIELD(live_streams, uint32_t);
@@ -74,6 +99,54 @@ public:
     return conf;
   };
 };
+
+// Router features beyond the websocket server, one struct per feature so
+// call sites set what they need by name and keep the other defaults
+struct UpstreamSettings final {
+  // 0 is one loop per core
+  int threads = 0;
+  // Channel buffers are sized in time, 64 bytes/ms is 16 kHz float32
+  uint32_t buffer_ms = 16000;
+  uint32_t audio_bytes_per_ms = 64;
+  std::string overflow_policy = "disconnect";
+  int batch_ms = 0;
+  uint32_t result_queue_bytes = 65536;
+  // Results go out from a relay thread instead of the client callbacks
+  bool push_results = false;
+  uint32_t pool_min_idle = 0;
+  uint32_t pool_max_idle = 8;
+  int pool_check_ms = 1000;
+};
+
+struct BalancerSettings final {
+  std::string policy = "round_robin";
+  int failover_ms = 2000;
+  uint32_t breaker_failures = 3;
+  int breaker_eject_ms = 5000;
+  int slow_handshake_ms = 0;
+  int probe_interval_ms = 0;
+};
+
+struct VadSettings final {
+  bool enabled = false;
+  double threshold_db = -45;
+  uint32_t hangover_ms = 300;
+};
+
+struct TraceSettings final {
+  double sample = 0.01;
+};
+
+struct RouterSettings final {
+  UpstreamSettings upstream;
+  BalancerSettings balancer;
+  TapOptions tap;
+  VadSettings vad;
+  TraceSettings trace;
+  CaptureOptions capture;
+  std::map<std::string, TenantLimits> limits;
+};
+
 CURRENT_STRUCT(VOMeta) {
   CURRENT_FIELD(account_id, std::string);
   CURRENT_FIELD(configuration_id, std::string);
@@ -84,41 +157,313 @@ CURRENT_STRUCT(VOHandshakeMessage) {
   CURRENT_FIELD(node_selector, Optional<std::string>);
   CURRENT_FIELD(speakers, std::vector<std::string>);
   CURRENT_FIELD(meta, VOMeta);
+  // Interleaved channels, one per speaker, split by the router unless
+  // downmixed. Audio that is not 16 kHz float32 is transcoded.
+  CURRENT_FIELD(channels, Optional<uint32_t>);
+  CURRENT_FIELD(sample_format, Optional<std::string>); // f32, s16, ulaw, alaw
+  CURRENT_FIELD(sample_rate, Optional<uint32_t>);      // 8000 or 16000
+  CURRENT_FIELD(downmix, Optional<bool>);
+  // Set by the router when the node takes a compressed wire format
+  CURRENT_FIELD(wire_format, Optional<std::string>);
+};
+
+// Channels are keyed by the websocket client object, which lives for the
+// whole connection, so the hot path never builds "address:port" strings
+using ChannelHandle = uintptr_t;
+inline ChannelHandle channel_handle(const WebsocketClient &client) {
+  return reinterpret_cast<ChannelHandle>(&client);
+}
+
+// Upstream call of one speaker, mono calls have a single leg
+struct ChannelLeg final {
+  std::shared_ptr<UpstreamConnection> conn;
+  std::shared_ptr<NodeStats> node_stats;
+  // Wire format of the first node, failover keeps to nodes that share it
+  std::unique_ptr<WireEncoder> encoder;
+  // Nodes that already failed this leg
+  std::vector<const NodeStats *> tried_nodes;
+  // Set when the call is sampled by the audio tap
+  std::shared_ptr<TapStream> tap;
+  // Skips silence on nodes with a framed wire format
+  std::unique_ptr<VoiceDetector> vad;
 };
 
-struct Channel final {
-  std::unique_ptr<current::net::Connection> conn;
+struct Channel final : std::enable_shared_from_this<Channel> {
+  // Per channel lock: serializes frames of a single call only
+  std::mutex mutex;
+  std::string id;
+  // Written under the mutex while not closed, results go back over it
+  WebsocketClient *client = nullptr;
+  bool closed = false;
+  uint32_t state = 0;
+  std::vector<ChannelLeg> legs;
   std::string node_selector;
-  uint32_t round_robin_id;
+  std::chrono::steady_clock::time_point failover_deadline;
+  // Multi channel or non float32 calls, one output buffer per leg
+  std::unique_ptr<Transcoder> transcoder;
+  std::vector<std::string> split;
+  // Non zero if the call is sampled for tracing
+  uint64_t trace_id = 0;
+  // Tenant limits the call counts against, audio is charged in batches
+  std::vector<std::shared_ptr<TenantLimiter>> limiters;
+  uint64_t uncharged_bytes = 0;
+  // Non zero if the call is captured for replay
+  uint32_t capture_id = 0;
+  // Written under the mutex, read lock free by /metrics
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> frames{0};
 };
 
-struct SharedState final {
-  bool die = false;
-  std::map<std::string, Channel> channels;
-  std::map<std::string, uint32_t> channel_states;
-  std::map<std::string, std::vector<VONode>> mapping;
-  bool channel_exists(const std::string &channel_id) const {
-    return channel_states.find(channel_id) != channel_states.end();
+class ChannelMap final {
+  // Sharded map of live channels, lookups only take the shard lock
+  static constexpr size_t kShards = 64;
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<ChannelHandle, std::shared_ptr<Channel>> channels;
+  };
+  std::array<Shard, kShards> shards_;
+  std::atomic<uint32_t> live_streams_{0};
+  // Streams per selector, only touched on call setup and teardown
+  std::mutex selectors_mutex_;
+  std::map<std::string, int64_t> selector_streams_;
+
+  Shard &shard(ChannelHandle handle) {
+    // Drop the allocation alignment bits before picking the shard
+    return shards_[(handle >> 4) % kShards];
+  }
+
+public:
+  std::shared_ptr<Channel> Add(ChannelHandle handle, std::string id) {
+    auto channel = std::make_shared<Channel>();
+    channel->id = std::move(id);
+    channel->trace_id = Tracer::Instance().Sample(channel->id);
+    auto &s = shard(handle);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.channels[handle] = channel;
+    return channel;
   }
-  VONode next_node(const std::string &id, const std::string &selector) {
-    std::string node_selector = default_selector;
-    if (mapping.find(selector) != mapping.end()) {
-      node_selector = selector;
+  std::shared_ptr<Channel> Find(ChannelHandle handle) {
+    auto &s = shard(handle);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.channels.find(handle);
+    if (it == s.channels.end()) {
+      return nullptr;
     }
-    channels[id].round_robin_id++;
-    if (channels[id].round_robin_id >= mapping[node_selector].size()) {
-      channels[id].round_robin_id = 0;
+    return it->second;
+  }
+  // before_close runs under the channel mutex while the legs are still open
+  std::shared_ptr<Channel>
+  Remove(ChannelHandle handle,
+         const std::function<void(Channel &)> &before_close = nullptr) {
+    std::shared_ptr<Channel> channel;
+    {
+      auto &s = shard(handle);
+      std::lock_guard<std::mutex> lock(s.mutex);
+      auto it = s.channels.find(handle);
+      if (it == s.channels.end()) {
+        return nullptr;
+      }
+      channel = std::move(it->second);
+      s.channels.erase(it);
+    }
+    // Wait for the in-flight frame, queued audio is flushed before close
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    if (before_close) {
+      before_close(*channel);
+    }
+    if (channel->state == 1) {
+      live_streams_--;
+      std::lock_guard<std::mutex> selectors_lock(selectors_mutex_);
+      selector_streams_[channel->node_selector]--;
     }
-    return mapping[node_selector][channels[id].round_robin_id];
+    channel->state = 2;
+    for (auto &leg : channel->legs) {
+      if (leg.conn) {
+        leg.conn->Close();
+        leg.conn.reset();
+      }
+      if (leg.node_stats) {
+        leg.node_stats->StreamClosed();
+        leg.node_stats.reset();
+      }
+    }
+    return channel;
+  }
+  // Must be called with channel mutex held
+  void MarkStreaming(Channel &channel) {
+    channel.state = 1;
+    live_streams_++;
+    std::lock_guard<std::mutex> lock(selectors_mutex_);
+    selector_streams_[channel.node_selector]++;
   }
-  static struct SharedState
-  FromMapping(std::map<std::string, std::vector<VONode>> mapping) {
-    SharedState state;
-    state.mapping = mapping;
-    return state;
+  uint32_t LiveStreams() const { return live_streams_.load(); }
+  std::map<std::string, int64_t> SelectorStreams() {
+    std::lock_guard<std::mutex> lock(selectors_mutex_);
+    return selector_streams_;
+  }
+  // Visits live channels holding only their shard lock
+  template <typename F> void ForEach(F &&f) {
+    for (auto &s : shards_) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      for (auto &[handle, channel] : s.channels) {
+        f(*channel);
+      }
+    }
   }
 };
 
+struct NoNodesError : std::logic_error {
+  using std::logic_error::logic_error;
+};
+
+class RoutingTable final {
+  // Readers take the current immutable snapshot without locking, updates
+  // build a new one and publish it with an atomic store (RCU). Calls keep
+  // the snapshot they picked from until they return.
+  struct Snapshot {
+    uint64_t version = 0;
+    std::map<std::string, std::vector<VONode>> mapping;
+    std::map<std::string, std::shared_ptr<SelectorBalancer>> balancers;
+  };
+
+  const BalancerPolicy policy_;
+  std::mutex update_mutex_;
+  std::shared_ptr<const Snapshot> snapshot_;
+  NodeRegistry nodes_;
+
+  std::shared_ptr<const Snapshot> snapshot() const {
+    return std::atomic_load(&snapshot_);
+  }
+  template <typename T>
+  static bool same_optional(const Optional<T> &a, const Optional<T> &b) {
+    return Exists(a) == Exists(b) && (!Exists(a) || Value(a) == Value(b));
+  }
+  static bool same_nodes(const std::vector<VONode> &a,
+                         const std::vector<VONode> &b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+      if (a[i].host != b[i].host || a[i].port != b[i].port ||
+          !same_optional(a[i].weight, b[i].weight) ||
+          !same_optional(a[i].wire_format, b[i].wire_format)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::shared_ptr<SelectorBalancer>
+  make_balancer(const std::vector<VONode> &nodes) {
+    std::vector<BalancedNode> balanced;
+    for (auto &node : nodes) {
+      WireFormat wire_format = WireFormat::F32;
+      if (Exists(node.wire_format) &&
+          !parse_wire_format(Value(node.wire_format), wire_format)) {
+        std::cout << "Unknown wire format '" << Value(node.wire_format)
+                  << "' for " << node.host << ":" << node.port
+                  << ", using f32" << std::endl;
+      }
+      balanced.push_back(BalancedNode{
+          node.host, node.port, Exists(node.weight) ? Value(node.weight) : 1,
+          wire_format, nodes_.Get(node.host, node.port)});
+    }
+    return std::make_shared<SelectorBalancer>(policy_, std::move(balanced));
+  }
+
+public:
+  RoutingTable(std::map<std::string, std::vector<VONode>> mapping,
+               BalancerPolicy policy)
+      : policy_(policy), snapshot_(std::make_shared<Snapshot>()) {
+    Update(mapping);
+  }
+
+  // Replaces the routing with mapping. Selectors missing from it are
+  // removed, unchanged ones keep their balancer and its round robin
+  // position. Returns false if nothing changed.
+  bool Update(const std::map<std::string, std::vector<VONode>> &mapping) {
+    std::lock_guard<std::mutex> lock(update_mutex_);
+    auto current = snapshot();
+    auto next = std::make_shared<Snapshot>();
+    next->mapping = mapping;
+    bool changed = mapping.size() != current->mapping.size();
+    for (auto &[key, value] : mapping) {
+      auto it = current->mapping.find(key);
+      if (it != current->mapping.end() && same_nodes(it->second, value)) {
+        next->balancers[key] = current->balancers.at(key);
+      } else {
+        next->balancers[key] = make_balancer(value);
+        changed = true;
+      }
+    }
+    if (!changed) {
+      return false;
+    }
+    next->version = current->version + 1;
+    std::atomic_store(&snapshot_,
+                      std::shared_ptr<const Snapshot>(std::move(next)));
+    return true;
+  }
+  uint64_t Version() const { return snapshot()->version; }
+  std::vector<std::pair<std::string, uint16_t>> Nodes() const {
+    auto current = snapshot();
+    std::set<std::pair<std::string, uint16_t>> nodes;
+    for (auto &[key, value] : current->mapping) {
+      for (auto &node : value) {
+        nodes.emplace(node.host, node.port);
+      }
+    }
+    return {nodes.begin(), nodes.end()};
+  }
+  // True if some node takes a framed wire format (s16, ulaw)
+  bool AnyFramed() const {
+    auto current = snapshot();
+    for (auto &[key, value] : current->mapping) {
+      for (auto &node : value) {
+        WireFormat wire_format = WireFormat::F32;
+        if (Exists(node.wire_format) &&
+            parse_wire_format(Value(node.wire_format), wire_format) &&
+            wire_format != WireFormat::F32) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+  NodeRegistry &Registry() { return nodes_; }
+
+  BalancedNode
+  next_node(const std::string &selector,
+            const std::vector<const NodeStats *> &exclude = {}) const {
+    auto current = snapshot();
+    auto it = current->balancers.find(selector);
+    if (it == current->balancers.end()) {
+      it = current->balancers.find(default_selector);
+    }
+    if (it == current->balancers.end() || it->second->Empty()) {
+      throw NoNodesError("no nodes for selector " + selector);
+    }
+    auto node = it->second->Pick(exclude);
+    if (!node) {
+      throw NoNodesError("no nodes left to try for selector " + selector);
+    }
+    return *node;
+  }
+};
+
+struct SharedState final {
+  std::atomic<bool> die{false};
+  // Draining routers finish the calls they have and refuse new ones
+  std::atomic<bool> draining{false};
+  ChannelMap channels;
+  RoutingTable routing;
+  AdmissionControl limits;
+  SharedState(std::map<std::string, std::vector<VONode>> mapping,
+              BalancerPolicy policy)
+      : routing(std::move(mapping), policy) {}
+  SharedState(const SharedState &) = delete;
+};
+
 std::pair<bool, std::map<std::string, std::vector<VONode>>>
 parse_config(std::string conf) {
   std::map<std::string, std::vector<VONode>> mapping;
@@ -128,6 +473,9 @@ parse_config(std::string conf) {
         current::json::ParseJSONUniversally(conf);
     for (const current::json::JSONObject::const_element element :
          Value<current::json::JSONObject>(parsed)) {
+      if (element.key == limits_key) {
+        continue;
+      }
       mapping[element.key] = ParseJSON<std::vector<VONode>>(
           current::json::AsJSON(element.value).c_str());
     }
@@ -142,6 +490,41 @@ parse_config(std::string conf) {
   return std::make_pair(is_ok, mapping);
 }
 
+// Tenant limits under the "$limits" key of the config, empty without it
+std::pair<bool, std::map<std::string, TenantLimits>>
+parse_limits(std::string conf) {
+  std::map<std::string, TenantLimits> limits;
+  bool is_ok = true;
+  try {
+    const current::json::JSONValue parsed =
+        current::json::ParseJSONUniversally(conf);
+    for (const auto &element : Value<current::json::JSONObject>(parsed)) {
+      if (element.key != limits_key) {
+        continue;
+      }
+      auto entries = ParseJSON<std::map<std::string, VOLimit>>(
+          current::json::AsJSON(element.value).c_str());
+      for (auto &[key, entry] : entries) {
+        auto &out = limits[key];
+        out.streams = Exists(entry.streams) ? Value(entry.streams) : 0;
+        out.calls_per_sec =
+            Exists(entry.calls_per_sec) ? Value(entry.calls_per_sec) : 0;
+        out.calls_burst =
+            Exists(entry.calls_burst) ? Value(entry.calls_burst) : 0;
+        out.bytes_per_sec =
+            Exists(entry.bytes_per_sec) ? Value(entry.bytes_per_sec) : 0;
+      }
+    }
+  } catch (JSONSchemaException &e) {
+    std::cout << "Error: Invalid schema of the limits." << std::endl;
+    is_ok = false;
+  } catch (TypeSystemParseJSONException &e) {
+    std::cout << "Error: Invalid json of the limits." << std::endl;
+    is_ok = false;
+  }
+  return std::make_pair(is_ok, limits);
+}
+
 std::string safe_env(std::string key) {
   char *env = std::getenv(key.c_str());
   if (env == NULL) {
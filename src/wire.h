@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dsp.h"
+
+// Router to ASR node wire formats. f32 is the raw 16 kHz float32 stream the
+// nodes always accepted, the compressed formats are framed:
+//
+//   WireFrameHeader (16 bytes, little endian) | payload
+//
+// Nodes opt in through the "wire_format" field of the VONode config, the
+// router announces it in the handshake it forwards.
+
+enum class WireFormat : uint8_t { F32 = 0, S16 = 1, Ulaw = 2 };
+
+inline bool parse_wire_format(const std::string &name, WireFormat &format) {
+  if (name == "f32") {
+    format = WireFormat::F32;
+  } else if (name == "s16") {
+    format = WireFormat::S16;
+  } else if (name == "ulaw") {
+    format = WireFormat::Ulaw;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char *wire_format_name(WireFormat format) {
+  static const char *names[] = {"f32", "s16", "ulaw"};
+  return names[static_cast<size_t>(format)];
+}
+
+#pragma pack(push, 1)
+struct WireFrameHeader final {
+  static constexpr uint8_t kVersion = 1;
+  // Audio skipped by the VAD, the payload is a u32 count of silent samples
+  // starting at timestamp
+  static constexpr uint16_t kFlagSilence = 1;
+  uint8_t version;
+  uint8_t format;
+  uint16_t flags;
+  uint32_t seq;
+  // Position of the first sample in 16 kHz samples since the call start
+  uint32_t timestamp;
+  uint32_t payload_bytes;
+};
+#pragma pack(pop)
+static_assert(sizeof(WireFrameHeader) == 16, "wire header is 16 bytes");
+
+// G.711 mu-law encode of float32 samples
+inline void f32_to_ulaw(const float *in, size_t n, char *out) {
+  constexpr int kBias = 0x84;
+  constexpr int kClip = 32635;
+  for (size_t i = 0; i < n; i++) {
+    float scaled = in[i] * 32768.0f;
+    int sample = scaled >= 32767.0f    ? 32767
+                 : scaled <= -32768.0f ? -32768
+                                       : int(scaled);
+    int sign = sample < 0 ? 0x80 : 0;
+    if (sign) {
+      sample = -sample;
+    }
+    sample = std::min(sample, kClip) + kBias;
+    int exponent = 7;
+    for (int mask = 0x4000; !(sample & mask) && exponent > 0; mask >>= 1) {
+      exponent--;
+    }
+    int mantissa = (sample >> (exponent + 3)) & 0x0F;
+    out[i] = char(~(sign | (exponent << 4) | mantissa));
+  }
+}
+
+class WireEncoder final {
+  // Per upstream leg: turns float32 audio into frames of the node format.
+  // A sample cut by the websocket message boundary waits for the next call.
+  // Silence is coalesced into one marker sent ahead of the next audio.
+  static constexpr uint32_t kMaxSilence = Transcoder::kOutputRate;
+  const WireFormat format_;
+  uint32_t seq_ = 0;
+  uint32_t timestamp_ = 0;
+  uint32_t silence_ = 0;
+  std::string pending_;
+  std::vector<float> samples_;
+  std::string frame_;
+
+  void append_header(uint16_t flags, uint32_t payload) {
+    WireFrameHeader header{WireFrameHeader::kVersion,
+                           static_cast<uint8_t>(format_), flags, seq_++,
+                           timestamp_, payload};
+    frame_.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+  void append_silence() {
+    append_header(WireFrameHeader::kFlagSilence, sizeof(silence_));
+    frame_.append(reinterpret_cast<const char *>(&silence_), sizeof(silence_));
+    timestamp_ += silence_;
+    silence_ = 0;
+  }
+
+public:
+  explicit WireEncoder(WireFormat format) : format_(format) {}
+
+  WireFormat Format() const { return format_; }
+  // Raw f32 has no framing to carry silence markers
+  bool Framed() const { return format_ != WireFormat::F32; }
+
+  // Aligned whole samples of pending audio + f32, the cut sample waits for
+  // the next call. EncodeTaken or SkipTaken then frame them.
+  const std::vector<float> &Take(std::string_view f32) {
+    if (!pending_.empty()) {
+      pending_.append(f32.data(), f32.size());
+      f32 = pending_;
+    }
+    const size_t n = f32.size() / sizeof(float);
+    samples_.resize(n);
+    std::memcpy(samples_.data(), f32.data(), n * sizeof(float));
+    if (pending_.empty()) {
+      pending_.assign(f32.data() + n * sizeof(float),
+                      f32.size() - n * sizeof(float));
+    } else {
+      pending_.erase(0, n * sizeof(float));
+    }
+    return samples_;
+  }
+
+  // Returns the bytes to queue upstream, empty if nothing is complete yet
+  std::string_view Encode(std::string_view f32, uint16_t flags = 0) {
+    if (format_ == WireFormat::F32) {
+      return f32;
+    }
+    Take(f32);
+    return EncodeTaken(flags);
+  }
+  // Drops the audio and counts it as silence, a marker goes out once a
+  // second of it piled up so the node timeline keeps moving
+  std::string_view Skip(std::string_view f32) {
+    Take(f32);
+    return SkipTaken();
+  }
+
+  // Encode and Skip of the samples of the last Take, framed formats only
+  std::string_view EncodeTaken(uint16_t flags = 0) {
+    const size_t n = samples_.size();
+    frame_.clear();
+    if (silence_ > 0) {
+      append_silence();
+    }
+    if (n == 0) {
+      return frame_;
+    }
+    const size_t payload = format_ == WireFormat::S16 ? 2 * n : n;
+    append_header(flags, uint32_t(payload));
+    const size_t offset = frame_.size();
+    frame_.resize(offset + payload);
+    auto body = &frame_[offset];
+    if (format_ == WireFormat::S16) {
+      f32_to_s16(samples_.data(), n, body);
+    } else {
+      f32_to_ulaw(samples_.data(), n, body);
+    }
+    timestamp_ += n;
+    return frame_;
+  }
+  std::string_view SkipTaken() {
+    silence_ += samples_.size();
+    frame_.clear();
+    if (silence_ >= kMaxSilence) {
+      append_silence();
+    }
+    return frame_;
+  }
+};
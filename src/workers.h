@@ -0,0 +1,252 @@
+#pragma once
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <glob.h>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+// Multi process mode: a master execs N router workers that share one memfd
+// segment. Node stream counts in it are live so balancing sees the load of
+// every worker, the other counters are published by each worker once a
+// second and summed by the master for /metrics.
+
+struct SharedNodeSlot final {
+  static constexpr size_t kHostSize = 64;
+  // 0 free, 1 being claimed, 2 ready
+  std::atomic<uint32_t> state{0};
+  uint16_t port = 0;
+  char host[kHostSize] = {};
+  std::atomic<int32_t> active_streams{0};
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> bytes{0};
+  // Share of each worker, taken back from the total if the worker dies
+  std::array<std::atomic<int32_t>, 64> worker_streams{};
+};
+
+struct SharedWorkerSlot final {
+  std::atomic<int32_t> pid{0};
+  std::atomic<uint32_t> live_streams{0};
+  std::atomic<uint32_t> draining{0};
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> bytes{0};
+  std::array<std::atomic<uint64_t>, static_cast<size_t>(ErrorType::Count)>
+      errors{};
+};
+
+struct SharedCounters final {
+  static constexpr size_t kMaxNodes = 1024;
+  static constexpr size_t kMaxWorkers = 64;
+  static_assert(sizeof(SharedNodeSlot::worker_streams) ==
+                    kMaxWorkers * sizeof(std::atomic<int32_t>),
+                "one stream count per worker");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "shared counters need lock free atomics");
+
+  // Written by the master, polled by the workers
+  std::atomic<uint32_t> drain{0};
+  std::atomic<int32_t> drain_timeout_sec{0};
+  std::atomic<uint32_t> stop{0};
+  std::atomic<uint32_t> workers{0};
+  std::array<SharedWorkerSlot, kMaxWorkers> worker;
+  std::array<SharedNodeSlot, kMaxNodes> nodes;
+
+  // Segment of this process, nullptr when running a single router
+  static SharedCounters *&Attached() {
+    static SharedCounters *counters = nullptr;
+    return counters;
+  }
+  static int &WorkerIndex() {
+    static int index = -1;
+    return index;
+  }
+
+  // New zeroed segment, fd stays open without CLOEXEC for the workers
+  static SharedCounters *Create(int &fd) {
+    fd = memfd_create("vocallout", 0);
+    if (fd < 0 || ftruncate(fd, sizeof(SharedCounters)) < 0) {
+      throw std::runtime_error("can't create the shared counters segment");
+    }
+    auto counters = Map(fd);
+    new (counters) SharedCounters();
+    return counters;
+  }
+  static SharedCounters *Map(int fd) {
+    auto memory = mmap(nullptr, sizeof(SharedCounters), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("can't map the shared counters segment");
+    }
+    return static_cast<SharedCounters *>(memory);
+  }
+
+  // Drops what a dead worker left behind so its calls stop counting
+  void Reap(size_t index) {
+    for (auto &slot : nodes) {
+      if (slot.state.load(std::memory_order_acquire) == 2) {
+        slot.active_streams -= slot.worker_streams[index].exchange(0);
+      }
+    }
+    auto &w = worker[index];
+    w.pid = 0;
+    w.live_streams = 0;
+    w.draining = 0;
+  }
+
+  // Slot of a node, claimed on first use by any worker. nullptr when the
+  // table is full, the node is then balanced on local counts only.
+  SharedNodeSlot *Node(const std::string &host, uint16_t port) {
+    if (host.size() >= SharedNodeSlot::kHostSize) {
+      return nullptr;
+    }
+    auto start = std::hash<std::string>{}(host + ":" + std::to_string(port));
+    for (size_t i = 0; i < kMaxNodes; i++) {
+      auto &slot = nodes[(start + i) % kMaxNodes];
+      uint32_t state = slot.state.load(std::memory_order_acquire);
+      if (state == 0) {
+        if (slot.state.compare_exchange_strong(state, 1)) {
+          slot.port = port;
+          std::memcpy(slot.host, host.c_str(), host.size() + 1);
+          slot.state.store(2, std::memory_order_release);
+          return &slot;
+        }
+      }
+      while (state == 1) {
+        sched_yield();
+        state = slot.state.load(std::memory_order_acquire);
+      }
+      if (slot.port == port && host == slot.host) {
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+};
+
+// Online cpus ordered by NUMA node, so consecutive slices stay on one node
+inline std::vector<int> numa_ordered_cpus() {
+  std::vector<int> cpus;
+  glob_t nodes;
+  if (glob("/sys/devices/system/node/node[0-9]*/cpulist", 0, nullptr,
+           &nodes) == 0) {
+    for (size_t i = 0; i < nodes.gl_pathc; i++) {
+      std::ifstream file(nodes.gl_pathv[i]);
+      std::string list, range;
+      std::getline(file, list);
+      std::stringstream ranges(list);
+      while (std::getline(ranges, range, ',')) {
+        if (range.empty()) {
+          continue;
+        }
+        auto dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos
+                       ? first
+                       : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    globfree(&nodes);
+  }
+  if (cpus.empty()) {
+    for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++) {
+      cpus.push_back(int(cpu));
+    }
+  }
+  return cpus;
+}
+
+// Pins the process to its slice of the cpus, returns the slice size
+inline int pin_worker(int index, int workers) {
+  auto cpus = numa_ordered_cpus();
+  int slice = std::max<int>(1, cpus.size() / std::max(workers, 1));
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i = 0; i < slice; i++) {
+    CPU_SET(cpus[(index * slice + i) % cpus.size()], &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    return 0;
+  }
+  return slice;
+}
+
+// Master side view of the workers for /metrics
+inline std::string shared_prometheus(SharedCounters &counters) {
+  PrometheusWriter out;
+  auto workers =
+      std::min<size_t>(counters.workers, SharedCounters::kMaxWorkers);
+  uint64_t live = 0, frames = 0, bytes = 0;
+  std::array<uint64_t, static_cast<size_t>(ErrorType::Count)> errors{};
+  for (size_t w = 0; w < workers; w++) {
+    auto &slot = counters.worker[w];
+    live += slot.live_streams;
+    frames += slot.frames;
+    bytes += slot.bytes;
+    for (size_t i = 0; i < errors.size(); i++) {
+      errors[i] += slot.errors[i];
+    }
+  }
+  out.Family("vocallout_workers", "gauge", "Router worker processes");
+  out.Sample("vocallout_workers", {}, workers);
+  out.Family("vocallout_draining", "gauge",
+             "1 while the router refuses new calls");
+  out.Sample("vocallout_draining", {}, counters.drain.load());
+  out.Family("vocallout_live_streams", "gauge", "Streams forwarded now");
+  out.Sample("vocallout_live_streams", {}, live);
+  out.Family("vocallout_worker_live_streams", "gauge",
+             "Streams forwarded now per worker");
+  for (size_t w = 0; w < workers; w++) {
+    out.Sample("vocallout_worker_live_streams",
+               {{"worker", std::to_string(w)}},
+               counters.worker[w].live_streams.load());
+  }
+  out.Family("vocallout_frames_total", "counter", "Audio frames forwarded");
+  out.Sample("vocallout_frames_total", {}, frames);
+  out.Family("vocallout_bytes_total", "counter", "Audio bytes forwarded");
+  out.Sample("vocallout_bytes_total", {}, bytes);
+  out.Family("vocallout_errors_total", "counter", "Errors by type");
+  for (size_t i = 0; i < errors.size(); i++) {
+    out.Sample("vocallout_errors_total",
+               {{"type", error_type_name(static_cast<ErrorType>(i))}},
+               errors[i]);
+  }
+  auto node_family = [&out, &counters](const std::string &name,
+                                       const std::string &type,
+                                       const std::string &help, auto value) {
+    out.Family(name, type, help);
+    for (auto &slot : counters.nodes) {
+      if (slot.state.load(std::memory_order_acquire) == 2) {
+        out.Sample(name,
+                   {{"node", std::string(slot.host) + ":" +
+                                 std::to_string(slot.port)}},
+                   value(slot));
+      }
+    }
+  };
+  node_family("vocallout_node_streams", "gauge", "Streams per node",
+              [](SharedNodeSlot &n) { return n.active_streams.load(); });
+  node_family("vocallout_node_frames_total", "counter",
+              "Audio frames forwarded per node",
+              [](SharedNodeSlot &n) { return n.frames.load(); });
+  node_family("vocallout_node_bytes_total", "counter",
+              "Audio bytes forwarded per node",
+              [](SharedNodeSlot &n) { return n.bytes.load(); });
+  return out.str();
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+// Minimal blocking websocket client (RFC 6455) used by the streamer and the
+// load tools to talk to the router the same way a PBX does.
+
+class WebsocketConnection final {
+  int fd_ = -1;
+  std::mt19937 random_;
+  std::string frame_;
+  std::string read_buffer_;
+
+  static std::string base64(const uint8_t *data, size_t size) {
+    static const char *chars =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+    for (size_t i = 0; i < size; i += 3) {
+      uint32_t chunk = uint32_t(data[i]) << 16;
+      if (i + 1 < size) {
+        chunk |= uint32_t(data[i + 1]) << 8;
+      }
+      if (i + 2 < size) {
+        chunk |= data[i + 2];
+      }
+      result += chars[(chunk >> 18) & 63];
+      result += chars[(chunk >> 12) & 63];
+      result += i + 1 < size ? chars[(chunk >> 6) & 63] : '=';
+      result += i + 2 < size ? chars[chunk & 63] : '=';
+    }
+    return result;
+  }
+
+  void write_all(const char *data, size_t size) {
+    while (size > 0) {
+      auto n = send(fd_, data, size, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(std::string("websocket write: ") +
+                                 std::strerror(errno));
+      }
+      data += n;
+      size -= n;
+    }
+  }
+  // Makes sure read_buffer_ holds at least size bytes, false on EOF
+  bool fill(size_t size) {
+    char chunk[16 * 1024];
+    while (read_buffer_.size() < size) {
+      auto n = recv(fd_, chunk, sizeof(chunk), 0);
+      if (n == 0) {
+        return false;
+      }
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(std::string("websocket read: ") +
+                                 std::strerror(errno));
+      }
+      read_buffer_.append(chunk, n);
+    }
+    return true;
+  }
+
+public:
+  static constexpr uint8_t kText = 0x1;
+  static constexpr uint8_t kBinary = 0x2;
+  static constexpr uint8_t kClose = 0x8;
+  static constexpr uint8_t kPing = 0x9;
+  static constexpr uint8_t kPong = 0xA;
+
+  WebsocketConnection(const std::string &host, uint16_t port,
+                      const std::string &path = "/")
+      : random_(std::random_device{}()) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                    &result) != 0 ||
+        result == nullptr) {
+      throw std::runtime_error("can't resolve " + host);
+    }
+    fd_ = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC,
+                 result->ai_protocol);
+    if (fd_ < 0 || connect(fd_, result->ai_addr, result->ai_addrlen) < 0) {
+      auto error = std::string("connect: ") + std::strerror(errno);
+      freeaddrinfo(result);
+      if (fd_ >= 0) {
+        close(fd_);
+      }
+      throw std::runtime_error(error);
+    }
+    freeaddrinfo(result);
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint8_t key[16];
+    for (auto &byte : key) {
+      byte = random_() & 0xFF;
+    }
+    auto request = "GET " + path + " HTTP/1.1\r\nHost: " + host + ":" +
+                   std::to_string(port) +
+                   "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                   "Sec-WebSocket-Key: " +
+                   base64(key, sizeof(key)) +
+                   "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    write_all(request.data(), request.size());
+    size_t end;
+    while ((end = read_buffer_.find("\r\n\r\n")) == std::string::npos) {
+      if (!fill(read_buffer_.size() + 1)) {
+        close(fd_);
+        throw std::runtime_error("websocket upgrade: connection closed");
+      }
+    }
+    if (read_buffer_.compare(0, 12, "HTTP/1.1 101") != 0) {
+      auto status = read_buffer_.substr(0, read_buffer_.find("\r\n"));
+      close(fd_);
+      throw std::runtime_error("websocket upgrade: " + status);
+    }
+    read_buffer_.erase(0, end + 4);
+  }
+  WebsocketConnection(const WebsocketConnection &) = delete;
+  ~WebsocketConnection() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  int Fd() const { return fd_; }
+
+  // Sends one masked frame
+  void Send(const void *data, size_t size, uint8_t opcode = kBinary) {
+    frame_.clear();
+    frame_ += char(0x80 | opcode);
+    if (size < 126) {
+      frame_ += char(0x80 | size);
+    } else if (size <= 0xFFFF) {
+      frame_ += char(0x80 | 126);
+      frame_ += char(size >> 8);
+      frame_ += char(size & 0xFF);
+    } else {
+      frame_ += char(0x80 | 127);
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        frame_ += char((uint64_t(size) >> shift) & 0xFF);
+      }
+    }
+    uint32_t mask = random_();
+    auto mask_bytes = reinterpret_cast<const char *>(&mask);
+    frame_.append(mask_bytes, 4);
+    auto header = frame_.size();
+    frame_.append(static_cast<const char *>(data), size);
+    for (size_t i = 0; i < size; i++) {
+      frame_[header + i] ^= mask_bytes[i & 3];
+    }
+    write_all(frame_.data(), frame_.size());
+  }
+  void SendText(const std::string &text) {
+    Send(text.data(), text.size(), kText);
+  }
+
+  // Reads the next data frame, answers pings, false once the server closed
+  bool Read(std::string &payload, uint8_t &opcode) {
+    while (true) {
+      if (!fill(2)) {
+        return false;
+      }
+      opcode = read_buffer_[0] & 0x0F;
+      bool masked = read_buffer_[1] & 0x80;
+      uint64_t size = read_buffer_[1] & 0x7F;
+      size_t offset = 2;
+      if (size == 126 || size == 127) {
+        size_t extra = size == 126 ? 2 : 8;
+        if (!fill(offset + extra)) {
+          return false;
+        }
+        size = 0;
+        for (size_t i = 0; i < extra; i++) {
+          size = (size << 8) | uint8_t(read_buffer_[offset + i]);
+        }
+        offset += extra;
+      }
+      char mask[4] = {0, 0, 0, 0};
+      if (masked) {
+        if (!fill(offset + 4)) {
+          return false;
+        }
+        std::memcpy(mask, read_buffer_.data() + offset, 4);
+        offset += 4;
+      }
+      if (!fill(offset + size)) {
+        return false;
+      }
+      payload.assign(read_buffer_, offset, size);
+      read_buffer_.erase(0, offset + size);
+      if (masked) {
+        for (size_t i = 0; i < payload.size(); i++) {
+          payload[i] ^= mask[i & 3];
+        }
+      }
+      if (opcode == kPing) {
+        Send(payload.data(), payload.size(), kPong);
+        continue;
+      }
+      if (opcode == kClose) {
+        return false;
+      }
+      return true;
+    }
+  }
+
+  void Close() {
+    if (fd_ < 0) {
+      return;
+    }
+    try {
+      Send("", 0, kClose);
+    } catch (const std::runtime_error &) {
+    }
+    shutdown(fd_, SHUT_WR);
+  }
+};
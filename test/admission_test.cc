@@ -0,0 +1,147 @@
+#include "admission.h"
+#include "check.h"
+
+namespace {
+
+constexpr int64_t kSecond = 1000000000;
+
+void check_rate_bucket() {
+  // 10 per second with a burst of 5
+  RateBucket bucket;
+  const int64_t now = 100 * kSecond;
+  int taken = 0;
+  for (int i = 0; i < 20; i++) {
+    taken += bucket.Take(1, 10, 5, now);
+  }
+  CHECK_EQ(taken, 5);
+  CHECK(!bucket.Available(10, 5, now));
+  // One token back after 100 ms
+  CHECK(bucket.Take(1, 10, 5, now + kSecond / 10));
+  CHECK(!bucket.Take(1, 10, 5, now + kSecond / 10));
+
+  // A refund makes the token available again, a full bucket stays full
+  bucket.Refund(1, 10);
+  CHECK(bucket.Take(1, 10, 5, now + kSecond / 10));
+  RateBucket full;
+  full.Refund(3, 10);
+  taken = 0;
+  for (int i = 0; i < 20; i++) {
+    taken += full.Take(1, 10, 5, now);
+  }
+  CHECK_EQ(taken, 5);
+}
+
+void check_charge() {
+  // Charged debt is capped at one more burst
+  RateBucket bytes;
+  const int64_t now = 100 * kSecond;
+  bytes.Charge(1e9, 1000, 1000, now);
+  CHECK(!bytes.Available(1000, 1000, now));
+  CHECK(!bytes.Available(1000, 1000, now + kSecond));
+  CHECK(bytes.Available(1000, 1000, now + kSecond + kSecond / 10));
+}
+
+void check_streams() {
+  TenantLimiter limiter;
+  TenantLimits limits;
+  limits.streams = 2;
+  limiter.Set(limits);
+  const int64_t now = limit_clock_ns();
+  CHECK(limiter.Admit(now) == LimitReason::None);
+  CHECK(limiter.Admit(now) == LimitReason::None);
+  CHECK(limiter.Admit(now) == LimitReason::Streams);
+  CHECK_EQ(limiter.Streams(), 2);
+  CHECK_EQ(limiter.rejected[size_t(LimitReason::Streams)].load(),
+           uint64_t(1));
+  limiter.Release();
+  CHECK(limiter.Admit(now) == LimitReason::None);
+
+  // Raising the limit applies to the live counters
+  limits.streams = 3;
+  limiter.Set(limits);
+  CHECK(limiter.Admit(now) == LimitReason::None);
+  CHECK_EQ(limiter.Streams(), 3);
+}
+
+void check_bytes() {
+  TenantLimiter limiter;
+  TenantLimits limits;
+  limits.bytes_per_sec = 1000;
+  limiter.Set(limits);
+  const int64_t now = limit_clock_ns();
+  CHECK(limiter.Admit(now) == LimitReason::None);
+  limiter.Charge(5000, now);
+  CHECK(limiter.Admit(now) == LimitReason::Bytes);
+  CHECK_EQ(limiter.Streams(), 1);
+}
+
+void check_rollback() {
+  // The selector rejects after the account admitted: the account gets its
+  // stream and its call token back
+  AdmissionControl control;
+  TenantLimits account;
+  account.streams = 10;
+  account.calls_per_sec = 1;
+  account.calls_burst = 2;
+  TenantLimits selector;
+  selector.streams = 1;
+  control.Update({{"acc", account}, {"acc:cfg", selector}});
+
+  std::vector<std::shared_ptr<TenantLimiter>> first, rejected;
+  CHECK(control.Admit("acc", "acc:cfg", first) == LimitReason::None);
+  CHECK_EQ(first.size(), size_t(2));
+  for (int i = 0; i < 5; i++) {
+    CHECK(control.Admit("acc", "acc:cfg", rejected) == LimitReason::Streams);
+    CHECK(rejected.empty());
+  }
+  // Limiters are held in account, selector order
+  auto account_limiter = first[0];
+  CHECK_EQ(account_limiter->Streams(), 1);
+  CHECK_EQ(account_limiter->rejected[size_t(LimitReason::Calls)].load(),
+           uint64_t(0));
+  // The second token of the burst is still there for another selector
+  std::vector<std::shared_ptr<TenantLimiter>> other;
+  CHECK(control.Admit("acc", "acc:other", other) == LimitReason::None);
+  CHECK_EQ(other.size(), size_t(1));
+  CHECK(control.Admit("acc", "acc:other", other) == LimitReason::Calls);
+  for (auto &limiter : first) {
+    limiter->Release();
+  }
+  for (auto &limiter : other) {
+    limiter->Release();
+  }
+  CHECK_EQ(account_limiter->Streams(), 0);
+}
+
+void check_update() {
+  // Limiters of keys that stay keep their counters, an empty table admits
+  AdmissionControl control;
+  TenantLimits limits;
+  limits.streams = 1;
+  control.Update({{"acc", limits}});
+  std::vector<std::shared_ptr<TenantLimiter>> held, more;
+  CHECK(control.Admit("acc", "acc:cfg", held) == LimitReason::None);
+  limits.streams = 2;
+  control.Update({{"acc", limits}, {"other", limits}});
+  CHECK(control.Admit("acc", "acc:cfg", more) == LimitReason::None);
+  CHECK(control.Admit("acc", "acc:cfg", more) == LimitReason::Streams);
+  CHECK(held[0] == more[0]);
+  control.Update({});
+  std::vector<std::shared_ptr<TenantLimiter>> free;
+  CHECK(control.Admit("acc", "acc:cfg", free) == LimitReason::None);
+  CHECK(free.empty());
+  CHECK_EQ(std::string(limit_reason_name(LimitReason::Bytes)),
+           std::string("bytes"));
+}
+
+} // namespace
+
+int main() {
+  check_rate_bucket();
+  check_charge();
+  check_streams();
+  check_bytes();
+  check_rollback();
+  check_update();
+  return check_result("admission_test");
+}
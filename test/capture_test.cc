@@ -0,0 +1,145 @@
+#include <unistd.h>
+
+#include <vector>
+
+#include "capture.h"
+#include "check.h"
+
+namespace {
+
+struct Read {
+  CaptureRecord record;
+  std::string payload;
+};
+
+std::vector<Read> read_all(const CaptureFile &file) {
+  std::vector<Read> records;
+  file.ForEach([&](const CaptureRecord &record, std::string_view payload) {
+    records.push_back(Read{record, std::string(payload)});
+  });
+  return records;
+}
+
+std::string temp_path(const char *name) {
+  return "/tmp/vocallout_" + std::to_string(getpid()) + "_" + name + ".vcpt";
+}
+
+void check_round_trip() {
+  auto path = temp_path("audio");
+  const std::string handshake = R"({"call_id":"c1"})";
+  const std::string frame(640, 'a');
+  const std::string large(FrameBlock::kSize + 1, 'b');
+  uint32_t call = 0;
+  {
+    CaptureOptions options;
+    options.path = path;
+    options.audio = true;
+    CaptureWriter writer(options);
+    CHECK(writer.Enabled());
+    call = writer.Open("c1", handshake);
+    CHECK(call != 0);
+    writer.Frame(call, frame);
+    writer.Frame(call, large);
+    writer.Close(call);
+    // A handshake that does not fit a block leaves the call out
+    CHECK_EQ(writer.Open("c2", large), 0u);
+    CHECK_EQ(writer.records.Value(), uint64_t(4));
+    CHECK_EQ(writer.dropped_audio.Value(), uint64_t(1));
+  }
+
+  CaptureFile file(path);
+  CHECK_EQ(file.Header().magic, CaptureFileHeader::kMagic);
+  CHECK(file.Header().flags & CaptureFileHeader::kFlagAudio);
+  auto records = read_all(file);
+  CHECK_EQ(records.size(), size_t(4));
+  if (records.size() == 4) {
+    CHECK_EQ(int(records[0].record.kind), int(CaptureRecord::Open));
+    CHECK_EQ(records[0].record.call, call);
+    CHECK_EQ(records[0].payload, handshake);
+    CHECK_EQ(int(records[1].record.kind), int(CaptureRecord::Frame));
+    CHECK_EQ(records[1].record.size, 640u);
+    CHECK_EQ(records[1].payload, frame);
+    // The large frame keeps its size but not its audio
+    CHECK_EQ(records[2].record.size, uint32_t(large.size()));
+    CHECK_EQ(records[2].record.stored, 0u);
+    CHECK_EQ(int(records[3].record.kind), int(CaptureRecord::Close));
+    CHECK(records[1].record.at_ns <= records[3].record.at_ns);
+  }
+  CHECK_EQ(file.Size(), sizeof(CaptureFileHeader) + 4 * sizeof(CaptureRecord) +
+                            handshake.size() + frame.size());
+  unlink(path.c_str());
+}
+
+void check_sizes_only() {
+  // Without audio frames keep their size, handshakes are always stored
+  auto path = temp_path("sizes");
+  {
+    CaptureOptions options;
+    options.path = path;
+    CaptureWriter writer(options);
+    auto call = writer.Open("c1", "{}");
+    for (int i = 0; i < 100; i++) {
+      writer.Frame(call, std::string(320, 'x'));
+    }
+    writer.Close(call);
+  }
+  CaptureFile file(path);
+  CHECK(!(file.Header().flags & CaptureFileHeader::kFlagAudio));
+  auto records = read_all(file);
+  CHECK_EQ(records.size(), size_t(102));
+  CHECK_EQ(records[0].payload, std::string("{}"));
+  CHECK_EQ(records[50].record.size, 320u);
+  CHECK(records[50].payload.empty());
+  unlink(path.c_str());
+}
+
+void check_sampling() {
+  CaptureOptions options;
+  options.path = temp_path("sampling");
+  options.sample = 0;
+  {
+    CaptureWriter writer(options);
+    CHECK_EQ(writer.Open("c1", "{}"), 0u);
+  }
+  CaptureWriter disabled(CaptureOptions{});
+  CHECK(!disabled.Enabled());
+  CHECK_EQ(disabled.Open("c1", "{}"), 0u);
+  unlink(options.path.c_str());
+}
+
+void check_damaged_files() {
+  // A record cut by a crash ends the walk, other files are refused
+  auto path = temp_path("cut");
+  {
+    CaptureOptions options;
+    options.path = path;
+    options.audio = true;
+    CaptureWriter writer(options);
+    auto call = writer.Open("c1", "{}");
+    writer.Frame(call, std::string(1000, 'x'));
+  }
+  CHECK_EQ(truncate(path.c_str(), sizeof(CaptureFileHeader) +
+                                      2 * sizeof(CaptureRecord) + 2 + 999),
+           0);
+  CHECK_EQ(read_all(CaptureFile(path)).size(), size_t(1));
+
+  CHECK_EQ(truncate(path.c_str(), 0), 0);
+  bool refused = false;
+  try {
+    CaptureFile empty(path);
+  } catch (const std::runtime_error &) {
+    refused = true;
+  }
+  CHECK(refused);
+  unlink(path.c_str());
+}
+
+} // namespace
+
+int main() {
+  check_round_trip();
+  check_sizes_only();
+  check_sampling();
+  check_damaged_files();
+  return check_result("capture_test");
+}
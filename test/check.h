@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cmath>
+#include <iostream>
+#include <string>
+
+// Assertions of the standalone checks under test/. They build with a plain
+// compiler and no Current dependencies, `make test` runs them. A failed
+// check is reported and counted, main returns check_result().
+
+inline int &check_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(condition)                                                      \
+  do {                                                                        \
+    if (!(condition)) {                                                       \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition       \
+                << ") failed" << std::endl;                                   \
+      check_failures()++;                                                     \
+    }                                                                         \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                        \
+  do {                                                                        \
+    auto check_a = (a);                                                       \
+    auto check_b = (b);                                                       \
+    if (!(check_a == check_b)) {                                              \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #a ", " #b    \
+                << ") failed: " << check_a << " != " << check_b << std::endl; \
+      check_failures()++;                                                     \
+    }                                                                         \
+  } while (0)
+
+#define CHECK_NEAR(a, b, eps)                                                 \
+  do {                                                                        \
+    double check_a = (a);                                                     \
+    double check_b = (b);                                                     \
+    if (!(std::fabs(check_a - check_b) <= (eps))) {                           \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK_NEAR(" #a ", " #b  \
+                << ") failed: " << check_a << " vs " << check_b << std::endl; \
+      check_failures()++;                                                     \
+    }                                                                         \
+  } while (0)
+
+inline int check_result(const char *name) {
+  std::cout << name << ": "
+            << (check_failures() ? std::to_string(check_failures()) +
+                                       " checks failed"
+                                 : std::string("OK"))
+            << std::endl;
+  return check_failures() ? 1 : 0;
+}
@@ -0,0 +1,220 @@
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "dsp.h"
+
+// The vector paths of the kernels against scalar references. Lengths are
+// odd so the scalar tails run as well, `make test` builds this file once
+// for the baseline target and once with AVX2.
+
+namespace {
+
+std::vector<float> noise(size_t n, float amplitude, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> dist(-amplitude, amplitude);
+  std::vector<float> out(n);
+  for (auto &sample : out) {
+    sample = dist(rng);
+  }
+  return out;
+}
+
+void check_deinterleave() {
+  const size_t frames = 1003;
+  auto in = noise(2 * frames, 1.0f, 1);
+  std::vector<float> left(frames), right(frames);
+  deinterleave2x32(reinterpret_cast<const char *>(in.data()), frames,
+                   reinterpret_cast<char *>(left.data()),
+                   reinterpret_cast<char *>(right.data()));
+  size_t mismatches = 0;
+  for (size_t i = 0; i < frames; i++) {
+    mismatches += left[i] != in[2 * i] || right[i] != in[2 * i + 1];
+  }
+  CHECK_EQ(mismatches, size_t(0));
+
+  // Generic path with 3 channels of 16 bit samples, and back
+  const uint32_t channels = 3;
+  std::vector<int16_t> pcm(channels * frames);
+  for (size_t i = 0; i < pcm.size(); i++) {
+    pcm[i] = int16_t(i * 7919);
+  }
+  std::vector<std::vector<int16_t>> split(channels,
+                                          std::vector<int16_t>(frames));
+  char *out[channels];
+  const char *back_in[channels];
+  for (uint32_t c = 0; c < channels; c++) {
+    out[c] = reinterpret_cast<char *>(split[c].data());
+    back_in[c] = out[c];
+  }
+  deinterleave(reinterpret_cast<const char *>(pcm.data()), frames, channels, 2,
+               out);
+  CHECK_EQ(split[2][5], pcm[5 * channels + 2]);
+  std::vector<int16_t> back(pcm.size());
+  interleave(back_in, frames, channels, 2,
+             reinterpret_cast<char *>(back.data()));
+  CHECK(back == pcm);
+}
+
+void check_g711() {
+  // Reference values of G.711, in 16 bit units
+  auto &ulaw = ulaw_table();
+  CHECK_EQ(ulaw[0xFF] * 32768.0f, 0.0f);
+  CHECK_EQ(ulaw[0x7F] * 32768.0f, 0.0f);
+  CHECK_EQ(ulaw[0x00] * 32768.0f, -32124.0f);
+  CHECK_EQ(ulaw[0x80] * 32768.0f, 32124.0f);
+  auto &alaw = alaw_table();
+  CHECK_EQ(alaw[0xD5] * 32768.0f, 8.0f);
+  CHECK_EQ(alaw[0x55] * 32768.0f, -8.0f);
+  CHECK_EQ(alaw[0xAA] * 32768.0f, 32256.0f);
+  CHECK_EQ(alaw[0x2A] * 32768.0f, -32256.0f);
+
+  // Gathered decode against the table
+  std::vector<char> codes(1003);
+  for (size_t i = 0; i < codes.size(); i++) {
+    codes[i] = char(i * 31);
+  }
+  std::vector<float> decoded(codes.size());
+  g711_to_f32(ulaw, codes.data(), codes.size(), decoded.data());
+  size_t mismatches = 0;
+  for (size_t i = 0; i < codes.size(); i++) {
+    mismatches += decoded[i] != ulaw[uint8_t(codes[i])];
+  }
+  CHECK_EQ(mismatches, size_t(0));
+}
+
+void check_s16() {
+  // Every 16 bit value survives the round trip
+  std::vector<int16_t> pcm(65536);
+  for (size_t i = 0; i < pcm.size(); i++) {
+    pcm[i] = int16_t(i - 32768);
+  }
+  std::vector<float> f32(pcm.size());
+  s16_to_f32(reinterpret_cast<const char *>(pcm.data()), pcm.size(),
+             f32.data());
+  CHECK_EQ(f32[0], -1.0f);
+  std::vector<int16_t> back(pcm.size());
+  f32_to_s16(f32.data(), f32.size(), reinterpret_cast<char *>(back.data()));
+  CHECK(back == pcm);
+
+  // Out of range samples saturate, in the vector body and in the tail
+  std::vector<float> loud(37);
+  for (size_t i = 0; i < loud.size(); i++) {
+    loud[i] = i % 2 ? 1.5f : -1.5f;
+  }
+  std::vector<int16_t> clipped(loud.size());
+  f32_to_s16(loud.data(), loud.size(),
+             reinterpret_cast<char *>(clipped.data()));
+  CHECK_EQ(clipped[1], int16_t(32767));
+  CHECK_EQ(clipped[2], int16_t(-32768));
+  CHECK_EQ(clipped[36], int16_t(-32768));
+
+  // Vector body and scalar tail round the same way
+  auto in = noise(1003, 1.0f, 2);
+  std::vector<int16_t> bulk(in.size()), single(in.size());
+  f32_to_s16(in.data(), in.size(), reinterpret_cast<char *>(bulk.data()));
+  for (size_t i = 0; i < in.size(); i++) {
+    f32_to_s16(&in[i], 1, reinterpret_cast<char *>(&single[i]));
+  }
+  CHECK(bulk == single);
+}
+
+void check_downmix() {
+  for (uint32_t channels : {2u, 3u}) {
+    const size_t frames = 1003;
+    auto in = noise(channels * frames, 1.0f, channels);
+    std::vector<float> out(frames);
+    downmix(in.data(), frames, channels, out.data());
+    double error = 0;
+    for (size_t i = 0; i < frames; i++) {
+      float sum = 0;
+      for (uint32_t c = 0; c < channels; c++) {
+        sum += in[i * channels + c];
+      }
+      error = std::max(error, double(std::fabs(out[i] - sum / channels)));
+    }
+    CHECK_NEAR(error, 0.0, 1e-6);
+  }
+}
+
+void check_energy_zcr() {
+  for (size_t n : {1u, 5u, 160u, 1003u}) {
+    auto in = noise(n, 0.5f, uint32_t(n));
+    float energy = 0;
+    uint32_t crossings = 0;
+    energy_zcr(in.data(), n, energy, crossings);
+    double expected_energy = 0;
+    uint32_t expected_crossings = 0;
+    for (size_t i = 0; i < n; i++) {
+      expected_energy += double(in[i]) * in[i];
+      if (i + 1 < n && std::signbit(in[i]) != std::signbit(in[i + 1])) {
+        expected_crossings++;
+      }
+    }
+    CHECK_NEAR(energy, expected_energy, 1e-4 * (1 + expected_energy));
+    CHECK_EQ(crossings, expected_crossings);
+  }
+}
+
+void check_upsampler() {
+  // Chunks of one sample only take the scalar path
+  auto in = noise(1003, 0.8f, 3);
+  Upsampler2x bulk, single;
+  std::vector<float> out(2 * in.size()), reference(2 * in.size());
+  bulk.Process(in.data(), in.size(), out.data());
+  for (size_t i = 0; i < in.size(); i++) {
+    single.Process(&in[i], 1, &reference[2 * i]);
+  }
+  double error = 0;
+  for (size_t i = 0; i < out.size(); i++) {
+    error = std::max(error, double(std::fabs(out[i] - reference[i])));
+  }
+  CHECK_NEAR(error, 0.0, 1e-5);
+
+  // Even outputs are the input delayed by 16 samples
+  CHECK_EQ(out[2 * 15], 0.0f);
+  CHECK_EQ(out[2 * 16], in[0]);
+  CHECK_EQ(out[2 * 500], in[484]);
+
+  // Unity gain at DC once the filter is full
+  Upsampler2x dc;
+  std::vector<float> ones(256, 1.0f), dc_out(512);
+  dc.Process(ones.data(), ones.size(), dc_out.data());
+  CHECK_NEAR(dc_out[401], 1.0, 1e-4);
+}
+
+void check_transcoder() {
+  // 8 kHz stereo ulaw turns into two 16 kHz float streams, a frame cut by
+  // the message boundary waits for the next message
+  Transcoder transcoder(SampleFormat::Ulaw, 8000, 2, false);
+  CHECK_EQ(transcoder.Outputs(), 2u);
+  std::vector<std::string> out;
+  transcoder.Process(std::string(161, char(0xFF)), out);
+  CHECK_EQ(out.size(), size_t(2));
+  CHECK_EQ(out[0].size(), 80 * 2 * sizeof(float));
+  transcoder.Process(std::string(1, char(0xFF)), out);
+  CHECK_EQ(out[1].size(), 2 * sizeof(float));
+
+  Transcoder mono(SampleFormat::S16, 16000, 2, true);
+  CHECK_EQ(mono.Outputs(), 1u);
+  bool rejected = false;
+  try {
+    Transcoder(SampleFormat::F32, 44100, 1, false);
+  } catch (const std::logic_error &) {
+    rejected = true;
+  }
+  CHECK(rejected);
+}
+
+} // namespace
+
+int main() {
+  check_deinterleave();
+  check_g711();
+  check_s16();
+  check_downmix();
+  check_energy_zcr();
+  check_upsampler();
+  check_transcoder();
+  return check_result("dsp_test");
+}
@@ -0,0 +1,91 @@
+#include "check.h"
+#include "redis_watch.h"
+
+namespace {
+
+using Reply = RedisWatcher::Reply;
+
+void check_scalars() {
+  std::string buffer = "+OK\r\n:42\r\n-ERR unknown\r\n";
+  size_t pos = 0;
+  Reply reply;
+  CHECK(RedisWatcher::parse(buffer, pos, reply));
+  CHECK_EQ(reply.type, '+');
+  CHECK_EQ(reply.value, std::string("OK"));
+  CHECK_EQ(pos, size_t(5));
+  Reply number;
+  CHECK(RedisWatcher::parse(buffer, pos, number));
+  CHECK_EQ(number.type, ':');
+  CHECK_EQ(number.value, std::string("42"));
+  Reply error;
+  CHECK(RedisWatcher::parse(buffer, pos, error));
+  CHECK_EQ(error.type, '-');
+  CHECK_EQ(error.value, std::string("ERR unknown"));
+  CHECK_EQ(pos, buffer.size());
+}
+
+void check_bulk() {
+  // Bulk strings may hold CRLF, the length decides
+  std::string buffer = "$6\r\nab\r\ncd\r\n$-1\r\n";
+  size_t pos = 0;
+  Reply reply;
+  CHECK(RedisWatcher::parse(buffer, pos, reply));
+  CHECK_EQ(reply.value, std::string("ab\r\ncd"));
+  Reply null;
+  CHECK(RedisWatcher::parse(buffer, pos, null));
+  CHECK_EQ(null.type, '$');
+  CHECK(null.value.empty());
+  CHECK_EQ(pos, buffer.size());
+}
+
+void check_pubsub_message() {
+  // What a keyspace event looks like on the subscription
+  std::string buffer = "*4\r\n$8\r\npmessage\r\n$11\r\n__keyspace*\r\n"
+                       "$31\r\n__keyspace@0__:vocallout_config\r\n"
+                       "$3\r\nset\r\n";
+  size_t pos = 0;
+  Reply reply;
+  CHECK(RedisWatcher::parse(buffer, pos, reply));
+  CHECK_EQ(reply.type, '*');
+  CHECK_EQ(reply.elements.size(), size_t(4));
+  CHECK_EQ(reply.elements[0].value, std::string("pmessage"));
+  CHECK_EQ(reply.elements[2].value,
+           std::string("__keyspace@0__:vocallout_config"));
+  CHECK_EQ(reply.elements[3].value, std::string("set"));
+  CHECK_EQ(pos, buffer.size());
+
+  Reply nested;
+  pos = 0;
+  CHECK(RedisWatcher::parse("*2\r\n*1\r\n:1\r\n*0\r\n", pos, nested));
+  CHECK_EQ(nested.elements.size(), size_t(2));
+  CHECK_EQ(nested.elements[0].elements[0].value, std::string("1"));
+  CHECK(nested.elements[1].elements.empty());
+}
+
+void check_partial() {
+  // Every prefix of a reply asks for more data and leaves pos alone
+  std::string full = "*3\r\n$9\r\nsubscribe\r\n$4\r\nchan\r\n:1\r\n";
+  size_t incomplete = 0;
+  for (size_t n = 0; n < full.size(); n++) {
+    size_t pos = 0;
+    Reply reply;
+    if (!RedisWatcher::parse(full.substr(0, n), pos, reply) && pos == 0) {
+      incomplete++;
+    }
+  }
+  CHECK_EQ(incomplete, full.size());
+  size_t pos = 0;
+  Reply reply;
+  CHECK(RedisWatcher::parse(full, pos, reply));
+  CHECK_EQ(reply.elements[1].value, std::string("chan"));
+}
+
+} // namespace
+
+int main() {
+  check_scalars();
+  check_bulk();
+  check_pubsub_message();
+  check_partial();
+  return check_result("redis_test");
+}
@@ -0,0 +1,182 @@
+#include <cstddef>
+#include <vector>
+
+#include "check.h"
+#include "wire.h"
+
+namespace {
+
+std::vector<WireFrameHeader> headers;
+
+// Splits an encoder output into its frames, payloads are returned in order
+std::vector<std::string> frames(std::string_view wire) {
+  std::vector<std::string> payloads;
+  headers.clear();
+  while (wire.size() >= sizeof(WireFrameHeader)) {
+    WireFrameHeader header;
+    std::memcpy(&header, wire.data(), sizeof(header));
+    wire.remove_prefix(sizeof(header));
+    CHECK(header.payload_bytes <= wire.size());
+    payloads.emplace_back(wire.substr(0, header.payload_bytes));
+    wire.remove_prefix(header.payload_bytes);
+    headers.push_back(header);
+  }
+  CHECK(wire.empty());
+  return payloads;
+}
+
+std::string f32_bytes(const std::vector<float> &samples) {
+  return std::string(reinterpret_cast<const char *>(samples.data()),
+                     samples.size() * sizeof(float));
+}
+
+void check_header_layout() {
+  CHECK_EQ(offsetof(WireFrameHeader, version), size_t(0));
+  CHECK_EQ(offsetof(WireFrameHeader, format), size_t(1));
+  CHECK_EQ(offsetof(WireFrameHeader, flags), size_t(2));
+  CHECK_EQ(offsetof(WireFrameHeader, seq), size_t(4));
+  CHECK_EQ(offsetof(WireFrameHeader, timestamp), size_t(8));
+  CHECK_EQ(offsetof(WireFrameHeader, payload_bytes), size_t(12));
+
+  WireFormat format;
+  CHECK(parse_wire_format("ulaw", format) && format == WireFormat::Ulaw);
+  CHECK(!parse_wire_format("opus", format));
+  CHECK_EQ(std::string(wire_format_name(WireFormat::S16)), std::string("s16"));
+}
+
+void check_f32_passthrough() {
+  WireEncoder encoder(WireFormat::F32);
+  CHECK(!encoder.Framed());
+  std::string audio(10, 'x');
+  auto wire = encoder.Encode(audio);
+  CHECK(wire.data() == audio.data());
+  CHECK_EQ(wire.size(), audio.size());
+}
+
+void check_s16_frames() {
+  WireEncoder encoder(WireFormat::S16);
+  CHECK(encoder.Framed());
+  auto audio = f32_bytes({0.5f, -0.5f, 0.25f});
+  auto payloads = frames(encoder.Encode(audio));
+  CHECK_EQ(payloads.size(), size_t(1));
+  CHECK_EQ(headers[0].version, WireFrameHeader::kVersion);
+  CHECK_EQ(int(headers[0].format), int(WireFormat::S16));
+  CHECK_EQ(headers[0].flags, uint16_t(0));
+  CHECK_EQ(headers[0].seq, 0u);
+  CHECK_EQ(headers[0].timestamp, 0u);
+  CHECK_EQ(headers[0].payload_bytes, 6u);
+  int16_t first;
+  std::memcpy(&first, payloads[0].data(), 2);
+  CHECK_EQ(first, int16_t(16384));
+
+  // A sample cut by the message boundary goes out with the next message
+  auto next = f32_bytes({0.1f, 0.2f});
+  CHECK(frames(encoder.Encode(next.substr(0, 6))).size() == 1);
+  CHECK_EQ(headers[0].seq, 1u);
+  CHECK_EQ(headers[0].timestamp, 3u);
+  CHECK_EQ(headers[0].payload_bytes, 2u);
+  frames(encoder.Encode(next.substr(6)));
+  CHECK_EQ(headers.size(), size_t(1));
+  CHECK_EQ(headers[0].seq, 2u);
+  CHECK_EQ(headers[0].timestamp, 4u);
+  CHECK_EQ(headers[0].payload_bytes, 2u);
+}
+
+void check_ulaw_frames() {
+  // Encoding a decoded code gives the code back, up to the sign of zero
+  auto &table = ulaw_table();
+  std::vector<float> samples(table.begin(), table.end());
+  WireEncoder encoder(WireFormat::Ulaw);
+  auto payloads = frames(encoder.Encode(f32_bytes(samples)));
+  CHECK_EQ(payloads.size(), size_t(1));
+  CHECK_EQ(headers[0].payload_bytes, 256u);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < 256; i++) {
+    mismatches += table[uint8_t(payloads[0][i])] != table[i];
+  }
+  CHECK_EQ(mismatches, size_t(0));
+}
+
+void check_silence_markers() {
+  WireEncoder encoder(WireFormat::S16);
+  std::vector<float> chunk(320, 0.01f);
+  frames(encoder.Encode(f32_bytes(chunk)));
+  // Skipped audio sends nothing until the next audio frame
+  CHECK(encoder.Skip(f32_bytes(chunk)).empty());
+  CHECK(encoder.Skip(f32_bytes(chunk)).empty());
+  auto payloads = frames(encoder.Encode(f32_bytes(chunk)));
+  CHECK_EQ(payloads.size(), size_t(2));
+  CHECK_EQ(headers[0].flags, WireFrameHeader::kFlagSilence);
+  CHECK_EQ(headers[0].seq, 1u);
+  CHECK_EQ(headers[0].timestamp, 320u);
+  uint32_t silent = 0;
+  std::memcpy(&silent, payloads[0].data(), sizeof(silent));
+  CHECK_EQ(silent, 640u);
+  // The audio after the marker keeps the timeline continuous
+  CHECK_EQ(headers[1].flags, uint16_t(0));
+  CHECK_EQ(headers[1].seq, 2u);
+  CHECK_EQ(headers[1].timestamp, 960u);
+
+  // Long silence is flushed once a second of it piled up
+  std::vector<float> second(Transcoder::kOutputRate / 2, 0.0f);
+  CHECK(encoder.Skip(f32_bytes(second)).empty());
+  frames(encoder.Skip(f32_bytes(second)));
+  CHECK_EQ(headers.size(), size_t(1));
+  CHECK_EQ(headers[0].seq, 3u);
+  CHECK_EQ(headers[0].timestamp, 1280u);
+  CHECK(encoder.Skip(f32_bytes(chunk)).empty());
+  frames(encoder.Encode(f32_bytes(chunk)));
+  CHECK_EQ(headers.size(), size_t(2));
+  CHECK_EQ(headers[1].timestamp, 1280u + Transcoder::kOutputRate + 320u);
+}
+
+void check_taken_samples() {
+  // Messages cut inside a sample still give the detector whole samples
+  WireEncoder encoder(WireFormat::S16);
+  std::vector<float> chunk(321);
+  for (size_t i = 0; i < chunk.size(); i++) {
+    chunk[i] = 0.001f * float(i);
+  }
+  auto audio = f32_bytes(chunk);
+  auto &first = encoder.Take(std::string_view(audio).substr(0, 641));
+  CHECK_EQ(first.size(), size_t(160));
+  CHECK_EQ(first[159], chunk[159]);
+  auto payloads = frames(encoder.SkipTaken());
+  CHECK(payloads.empty());
+  auto &second = encoder.Take(std::string_view(audio).substr(641));
+  CHECK_EQ(second.size(), size_t(161));
+  CHECK_EQ(second[0], chunk[160]);
+  CHECK_EQ(second[160], chunk[320]);
+  payloads = frames(encoder.EncodeTaken());
+  CHECK_EQ(payloads.size(), size_t(2));
+  CHECK_EQ(headers[1].timestamp, 160u);
+  CHECK_EQ(headers[1].payload_bytes, 322u);
+}
+
+void check_voice_detector() {
+  VoiceDetector vad(-45, 30);
+  std::vector<float> silence(320, 0.0f);
+  std::vector<float> speech(320);
+  for (size_t i = 0; i < speech.size(); i++) {
+    speech[i] = 0.3f * float(std::sin(0.05 * double(i)));
+  }
+  CHECK(!vad.Active(silence.data(), silence.size()));
+  CHECK(vad.Active(speech.data(), speech.size()));
+  // 30 ms of hangover, the chunks hold two 10 ms windows
+  CHECK(vad.Active(silence.data(), silence.size()));
+  CHECK(vad.Active(silence.data(), silence.size()));
+  CHECK(!vad.Active(silence.data(), silence.size()));
+}
+
+} // namespace
+
+int main() {
+  check_header_layout();
+  check_f32_passthrough();
+  check_s16_frames();
+  check_ulaw_frames();
+  check_silence_markers();
+  check_taken_samples();
+  check_voice_detector();
+  return check_result("wire_test");
+}